@@ -0,0 +1,168 @@
+# Utility to compress WiFi firmware for ZeroWi, using LZ4 block format
+# From iosoft.blog, copyright (c) Jeremy P bentham 2020
+#
+# The firmware is split into independent blocks, each of which
+# decompresses to BLOCK_SIZE bytes (except the last). Each block is
+# preceded by a 2-byte little-endian header, giving the compressed length,
+# with the top bit set if the data is stored uncompressed. The stream
+# ends with a zero header. Writes C source, and binary for flash memory.
+
+import sys, zlib
+
+# Defaults
+in_fname  = "firmware/brcmfmac43430-sdio.bin"
+out_fname = "firmware/brcmfmac43430-sdio-lz4"
+verbose   = False
+
+# LZ4 settings (block size must match firmware buffer size)
+BLOCK_SIZE  = 0x2000
+MIN_MATCH   = 4
+LAST_LITS   = 5
+MFLIMIT     = 12
+MAX_CHAIN   = 64
+RAW_FLAG    = 0x8000
+
+# Add LZ4 length extension bytes
+def add_len(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+# Add LZ4 sequence: literals, and optional match
+def add_seq(out, lits, offset, mlen):
+    ml = mlen - MIN_MATCH if offset else 0
+    out.append((min(len(lits), 15) << 4) | min(ml, 15))
+    if len(lits) >= 15:
+        add_len(out, len(lits) - 15)
+    out += lits
+    if offset:
+        out += bytes([offset & 0xff, offset >> 8])
+        if ml >= 15:
+            add_len(out, ml - 15)
+
+# Return length & offset of longest match at position n
+def find_match(data, n, table):
+    best, offset, end = 0, 0, len(data) - LAST_LITS
+    for ref in reversed(table.get(data[n:n+MIN_MATCH], [])[-MAX_CHAIN:]):
+        mlen = MIN_MATCH
+        while n+mlen < end and data[ref+mlen] == data[n+mlen]:
+            mlen += 1
+        if mlen > best:
+            best, offset = mlen, n - ref
+    return best, offset
+
+# Add position to hash chain
+def add_hash(data, n, table):
+    table.setdefault(data[n:n+MIN_MATCH], []).append(n)
+
+# Compress a block, taking longest match from hash chain,
+# unless the next position has a longer match
+def lz4_compress(data):
+    out, table = bytearray(), {}
+    n, anchor, end = 0, 0, len(data)
+    while n < end - MFLIMIT:
+        mlen, offset = find_match(data, n, table)
+        add_hash(data, n, table)
+        if mlen and n+1 < end-MFLIMIT:
+            mlen2, offset2 = find_match(data, n+1, table)
+            if mlen2 > mlen+1:
+                n += 1
+                continue
+        if not mlen:
+            n += 1
+            continue
+        add_seq(out, data[anchor:n], offset, mlen)
+        for i in range(n+1, min(n+mlen, end-MFLIMIT)):
+            add_hash(data, i, table)
+        n += mlen
+        anchor = n
+    add_seq(out, data[anchor:], 0, 0)
+    return out
+
+# Decompress a block, to check the compressor
+def lz4_decompress(data):
+    out, n = bytearray(), 0
+    while n < len(data):
+        token = data[n]
+        n += 1
+        nlits = token >> 4
+        if nlits == 15:
+            while True:
+                nlits += data[n]
+                n += 1
+                if data[n-1] != 255:
+                    break
+        out += data[n:n+nlits]
+        n += nlits
+        if n >= len(data):
+            break
+        offset = data[n] | data[n+1] << 8
+        n += 2
+        mlen = token & 15
+        if mlen == 15:
+            while True:
+                mlen += data[n]
+                n += 1
+                if data[n-1] != 255:
+                    break
+        for i in range(mlen + MIN_MATCH):
+            out.append(out[-offset])
+    return out
+
+# Compress data into stream of blocks
+def compress(data):
+    out = bytearray()
+    for n in range(0, len(data), BLOCK_SIZE):
+        blk = data[n:n+BLOCK_SIZE]
+        comp = lz4_compress(blk)
+        if lz4_decompress(comp) != blk:
+            print("Compression error at block %u" % (n // BLOCK_SIZE))
+            sys.exit(1)
+        if len(comp) >= len(blk):
+            hdr, comp = len(blk) | RAW_FLAG, blk
+        else:
+            hdr = len(comp)
+        out += bytes([hdr & 0xff, hdr >> 8]) + comp
+        if verbose:
+            print("Block %3u: %u bytes" % (n // BLOCK_SIZE, len(comp)))
+    return out + bytes([0, 0])
+
+# Write C source file with compressed data
+def write_c(fname, data, rawlen, crc):
+    with open(fname, "w", newline="\r\n") as f:
+        f.write("// Cypress CYW 4343x firmware, LZ4 compressed (generated by firm_lz4.py)\n")
+        f.write("// From https://github.com/RPi-Distro/firmware-nonfree/blob/master/brcm/brcmfmac43430-sdio.bin\n")
+        f.write("// %u bytes uncompressed, %u compressed, CRC32 0x%08x\n" % (rawlen, len(data), crc))
+        f.write("const unsigned char firmware_lz4[%u] = {\n" % len(data))
+        for n in range(0, len(data), 20):
+            line = ", ".join(["0x%02X" % b for b in data[n:n+20]])
+            f.write("  " + line + (",\n" if n+20 < len(data) else "\n"))
+        f.write("};\n")
+
+if __name__ == "__main__":
+    opt = None
+    for arg in sys.argv[1:]:
+        if len(arg)==2 and arg[0]=="-":
+            opt = arg.lower()
+            if opt == "-v":
+                verbose = True
+                opt = None
+        elif opt == '-i':
+            in_fname = arg
+            opt = None
+        elif opt == '-o':
+            out_fname = arg
+            opt = None
+    with open(in_fname, "rb") as f:
+        data = f.read()
+    data += bytes((4 - len(data) % 4) % 4)
+    comp = compress(data)
+    crc = zlib.crc32(data)
+    write_c(out_fname + ".c", comp, len(data), crc)
+    with open(out_fname + ".bin", "wb") as f:
+        f.write(comp)
+    print("%s: %u bytes, compressed to %u (%u%%)" % (in_fname, len(data),
+          len(comp), 100 * len(comp) // len(data)))
+    print("FIRMWARE_LEN 0x%x, FIRMWARE_CRC32 0x%08x" % (len(data), crc))
+#EOF
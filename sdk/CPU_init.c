@@ -15,6 +15,14 @@
 #define RPI3_IO_BASE_ADDRESS       0x3F000000
 
 
+/* BCM2835 interrupt controller, at virtual IO address */
+#define IRQ_BASE           (RPI1_IO_BASE_ADDRESS + 0xB200)
+#define IRQ_PENDING1       ((volatile unsigned int *)(IRQ_BASE + 0x204))
+#define IRQ_ENABLE1        ((volatile unsigned int *)(IRQ_BASE + 0x210))
+#define IRQ_DISABLE1       ((volatile unsigned int *)(IRQ_BASE + 0x21C))
+#define IRQ_DISABLE_BASIC  ((volatile unsigned int *)(IRQ_BASE + 0x224))
+#define NB_IRQ             64
+
 /* number of 1M section in 4 GB address space */
 #define NB_1M_SECTION (0x100000000LL / 0x00100000)
 extern unsigned int CPU_init_page_table[NB_1M_SECTION];
@@ -32,6 +40,11 @@ extern void CPU_init_clean_and_invalidate_data_cache();
 extern void CPU_init_invalidate_instruction_cache();
 extern void CPU_init_disable_caches();
 
+/* handlers for GPU peripheral interrupts 0 - 63 */
+void (*CPU_irq_handlers[NB_IRQ])(void);
+
+void CPU_irq_init();
+
 void CPU_init_map_section(
    unsigned int  *page_table,
    unsigned int   virtual_address,
@@ -104,6 +117,71 @@ void CPU_init()
    CPU_init_invalidate_tlb();
    CPU_init_start_mmu((unsigned int *)((unsigned int)CPU_init_page_table),0x1005); /* ICACHE DCACHE and MMU ON */
    CPU_init_enable_vfp();
+   CPU_irq_init();
+
+   return;
+}
+
+/* disable all interrupt sources, IRQs are still masked in the CPSR */
+void CPU_irq_init()
+{
+   unsigned int i;
+
+   IRQ_DISABLE1[0] = 0xFFFFFFFF;
+   IRQ_DISABLE1[1] = 0xFFFFFFFF;
+   *IRQ_DISABLE_BASIC = 0xFFFFFFFF;
+   for (i = 0; i < NB_IRQ; i++)
+   {
+      CPU_irq_handlers[i] = 0;
+   }
+   return;
+}
+
+/* attach a handler to a peripheral interrupt, and enable it */
+void CPU_irq_attach(int irq, void (*handler)(void))
+{
+   if (irq >= 0 && irq < NB_IRQ)
+   {
+      CPU_irq_handlers[irq] = handler;
+      IRQ_ENABLE1[irq / 32] = 1 << (irq % 32);
+   }
+   return;
+}
 
+/* disable a peripheral interrupt, and remove its handler */
+void CPU_irq_detach(int irq)
+{
+   if (irq >= 0 && irq < NB_IRQ)
+   {
+      IRQ_DISABLE1[irq / 32] = 1 << (irq % 32);
+      CPU_irq_handlers[irq] = 0;
+   }
+   return;
+}
+
+/* called from the IRQ vector: run the handler of each pending interrupt */
+/* the handler must clear the interrupt source */
+void CPU_irq_handler()
+{
+   unsigned int i, pending;
+
+   for (i = 0; i < NB_IRQ; i += 32)
+   {
+      pending = IRQ_PENDING1[i / 32] & IRQ_ENABLE1[i / 32];
+      while (pending)
+      {
+         unsigned int n = __builtin_ctz(pending);
+
+         pending &= pending - 1;
+         if (CPU_irq_handlers[i + n])
+         {
+            CPU_irq_handlers[i + n]();
+         }
+         else
+         {
+            IRQ_DISABLE1[i / 32] = 1 << n;
+         }
+      }
+   }
    return;
 }
@@ -27,42 +27,15 @@
 #include "whd_wlioctl.h"
 
 #include "zw_gpio.h"
+#include "zw_crc.h"
 #include "zw_sdio.h"
 #include "zw_regs.h"
 #include "zw_ioctl.h"
+#include "zw_init.h"
 
 // WiFi channel number to scan (0 for all channels)
 #define SCAN_CHAN       1
 
-// Set non-zero to include WiFi firmware in image
-#define INCLUDE_FIRMWARE 1
-#define FIRMWARE_FNAME   "../firmware/brcmfmac43430-sdio.c"
-
-// Length of firmware file (rounded up to 4-byte value)
-#define FIRMWARE_LEN    0x5ee84
-#if INCLUDE_FIRMWARE
-extern const unsigned char firmware_bin[FIRMWARE_LEN];
-uint32_t firmware_pos;
-#endif
-
-// Configuration for brcmfmac43430-sdio
-uint8_t config_data[] = 
-"manfid=0x2d0\0""prodid=0x0726\0""vendid=0x14e4\0""devid=0x43e2\0"
-"boardtype=0x0726\0""boardrev=0x1202\0""boardnum=22\0""macaddr=00:90:4c:c5:12:38\0"
-"sromrev=11\0""boardflags=0x00404201\0""boardflags3=0x08000000\0""xtalfreq=37400\0"
-"nocrc=1\0""ag0=255\0""aa2g=1\0""ccode=ALL\0""pa0itssit=0x20\0""extpagain2g=0\0"
-"pa2ga0=-168,7161,-820\0""AvVmid_c0=0x0,0xc8\0""cckpwroffset0=5\0""maxp2ga0=84\0"
-"txpwrbckof=6\0""cckbw202gpo=0\0""legofdmbw202gpo=0x66111111\0"
-"mcsbw202gpo=0x77711111\0""propbw202gpo=0xdd\0""ofdmdigfilttype=18\0"
-"ofdmdigfilttypebe=18\0""papdmode=1\0""papdvalidtest=1\0""pacalidx2g=32\0"
-"papdepsoffset=-36\0""papdendidx=61\0""il0macaddr=00:90:4c:c5:12:38\0"
-"wl0id=0x431b\0""deadman_to=0xffffffff\0""muxenab=0x1\0""spurconfig=0x3 \0"
-"btc_mode=1\0""btc_params8=0x4e20\0""btc_params1=0x7530\0""\0\0\0\0\xaa\x00\x55\xff";
-int config_len = sizeof(config_data) - 1;
-
-// SDIO Tx buffer (must be multiple of 256, and less than 32K)
-uint8_t txbuffer[0x4000];
-
 // Network scan parameters
 #define SCAN_CHAN_TIME      40
 #define SSID_MAXLEN         32
@@ -100,54 +73,50 @@ SCAN_PARAMS scan_params = {
 #endif
 };
 
-// Escan result event (excluding 12-byte IOCTL header)
-typedef struct {
-    uint8_t pad[10];
-    whd_event_t event;
-    wl_escan_result_t escan;
-} escan_result;
-
 // IOCTL commands
 #define IOCTL_UP                    2
 #define IOCTL_SET_SCAN_CHANNEL_TIME 0xb9
 
 // Event handling
-uint8_t eventbuff[1600];
 EVT_STR escan_evts[]=ESCAN_EVTS;
 
-// State of SDIO clock line
-extern uint8_t clkval;
+// SDIO clock when idle: continuous, only while waiting, or timer interrupt
+#define IDLE_MODE       SD_IDLE_TIMER
 
 void disp_ssid(uint8_t *data);
 void disp_mac_addr(uint8_t *data);
 void disp_block(uint8_t *data, int len);
 void gdb_break(void);
-int sdio_init(void);
-int write_firmware(void);
-int write_nvram(void);
 void disp_bytes(uint8_t *addr, int len);
-void sd_setup(void);
+void escan_event(struct whd_event_msg *msg, uint8_t *data, int dlen);
 
 int main(void)
 {
-    int ticks=0, ledon=0, n;
+    int ticks=0, ledon=0, n, startime=ustime();
     uint32_t val=0;
     uint8_t resp[256] = {0}, eth[7]={0};
-    IOCTL_EVENT_HDR ieh;
-    escan_result *erp = (escan_result *)eventbuff;
+    EVT_SLOT *sp;
 
     crc7_init();
     qcrc16r_init();
+    crc32_init();
+    dout_init();
     ustimeout(&ticks, 0);
+    cycle_init();
+    sdio_set_clk_ns(SD_CLK_NSEC);
     printf("\nZerowi scan test v" VERSION "\n");
     fflush(stdout);
     osc_init();
     gpio_set(LED_PIN, GPIO_OUT, GPIO_NOPULL);
     sd_setup();
     gpio_out(WLAN_ON_PIN, 1);
-    flash_init(10000);
+    flash_init(FLASH_KHZ);
+#if !INCLUDE_FIRMWARE
+    flash_speed_test(FLASH_TEST_LEN);
+#endif
     usdelay(10000);
     log_enable(2);
+    sdio_crc_defer(1);
     sdio_init();
     sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, resp, 64);
     n = ioctl_get_data("cur_etheraddr", 0, eth, 6);
@@ -165,39 +134,60 @@ int main(void)
         fflush(stdout);
         gdb_break();
     }
+    printf("Boot to WLC_UP %d msec (%s start)\n", (ustime() - startime) / 1000,
+           init_warm ? "warm" : "cold");
     sdio_bak_write32(SB_INT_STATUS_REG, val);
     sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, (void *)resp, 64);
-    ioctl_enable_evts(escan_evts);
+    ioctl_subscribe_evts(escan_evts);
+    ioctl_evt_register(WLC_E_ESCAN_RESULT, escan_event);
+    sdio_irq_init(0);
+    sdio_idle_mode(IDLE_MODE);
     ioctl_set_data("escan", 0, &scan_params, sizeof(scan_params));
+    // Read scan results when the chip interrupts (or frames were left in chip),
+    // ack first, then re-arm
+    sdio_irq_arm();
     while (1)
     {
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, clkval=!clkval);
+        sdio_idle();
+        if (sdio_irq_flag || evtq.more)
+        {
+            ioctl_irq_ack();
+            evtq_receive();
+            sdio_irq_arm();
+        }
+        while ((sp = evtq_get()) != 0)
+        {
+            ioctl_evt_dispatch(sp);
+            evtq_release();
+        }
         if (ustimeout(&ticks, 100000))
         {
             gpio_out(LED_PIN, ledon = !ledon);
             if (!ledon)
             {
-                n = ioctl_get_event(&ieh, eventbuff, sizeof(eventbuff));
-                if (n > sizeof(escan_result))
-                {
-                    printf("%u bytes\n", n);
-                    disp_mac_addr((uint8_t *)&erp->event.whd_event.addr);
-                    printf(" %2u ", SWAP16(erp->escan.bss_info->chanspec));
-                    disp_ssid(&erp->escan.bss_info->SSID_len);
-                    printf("\n");
-                    fflush(stdout);
-                }
-                else
-                {
-                    printf(".");
-                    fflush(stdout);
-                }
+                printf(".");
+                fflush(stdout);
             }
         }
     }
 }
 
+// Display escan result
+void escan_event(struct whd_event_msg *msg, uint8_t *data, int dlen)
+{
+    wl_escan_result_t *erp = (wl_escan_result_t *)data;
+
+    if (dlen > sizeof(wl_escan_result_t))
+    {
+        printf("%u bytes\n", dlen);
+        disp_mac_addr(msg->addr.octet);
+        printf(" %2u ", SWAP16(erp->bss_info->chanspec));
+        disp_ssid(&erp->bss_info->SSID_len);
+        printf("\n");
+        fflush(stdout);
+    }
+}
+
 // Display SSID, prefixed with length byte
 void disp_ssid(uint8_t *data)
 {
@@ -231,7 +221,7 @@ void disp_block(uint8_t *data, int len)
     while (i < len)
     {
         n = MIN(len-i, 32);
-        disp_bytes(&eventbuff[i], n);
+        disp_bytes(&data[i], n);
         i += n;
         printf("\n");
         fflush(stdout);
@@ -243,235 +233,5 @@ void gdb_break(void)
 {
 } // Trigger GDB break
 
-// Initialise SDIO card, return RCA
-int sdio_init(void)
-{
-    SDIO_MSG resp;
-    int rca=0;
-    U32DATA u32d;
-    uint8_t data[520];
-
-    sdio_cmd52(SD_FUNC_BUS, 0x06,    0, SD_RD, 0, 0);   
-    usdelay(20000);
-    sdio_cmd52(SD_FUNC_BUS, 0x06,    8, SD_WR, 0, 0);   
-    usdelay(20000);
-    sdio_cmd(0, 0, 0);
-    sdio_cmd(8, 0x1aa, 0);
-    // Enable I/O mode
-    sdio_cmd(5, 0, 0);
-    sdio_cmd(5, 0x200000, 0);
-    // Assert SD device
-    sdio_cmd(3, 0, &resp);
-    rca = SWAP16(resp.rsp3.rcax);
-    sdio_cmd7(rca, 0);
-    // [0.243831] Set bus interface
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_SPEED_CTRL_REG, 0x03, 1);
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_BI_CTRL_REG, 0x42, 1);
-    // [17.999101] Set block sizes
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_BAK_BLKSIZE_REG, SD_BAK_BLK_BYTES, 2);
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_RAD_BLKSIZE_REG, SD_RAD_BLK_BYTES, 2);
-    // [17.999944] Enable I/O 
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_IOEN_REG, 1<<SD_FUNC_BAK, 1);
-    if (!sdio_cmd52_reads_check(SD_FUNC_BUS, BUS_IORDY_REG, 0xff, 2, 1))
-        disp_log_break();
-    // [18.001750] Set backplane window
-    sdio_bak_window(BAK_BASE_ADDR);
-    // [18.001905] Read chip ID 
-    sdio_cmd53_read(SD_FUNC_BAK, SB_32BIT_WIN, u32d.bytes, 4);
-    // [18.002173] Set chip clock
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0x28, 1);
-    sdio_cmd52_reads(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, &u32d.uint32, 1);
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0x21, 1);
-    // [18.004850] Disable pullups 
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_PULLUP_REG, 0, 1);
-    // Get chip ID again, and config base addr [18.005201]
-    sdio_cmd53_read(SD_FUNC_BAK, SB_32BIT_WIN, u32d.bytes, 4);
-    sdio_cmd53_read(SD_FUNC_BAK, SB_32BIT_WIN+0xfc, u32d.bytes, 4);
-    // Reset cores [18.030305]
-    sdio_bak_write32(ARM_IOCTRL_REG, 0x03);
-    sdio_bak_write32(MAC_IOCTRL_REG, 0x07);
-    sdio_bak_write32(MAC_RESETCTRL_REG, 0x00);
-    sdio_bak_write32(MAC_IOCTRL_REG, 0x05);
-    // [18.032572]
-    sdio_bak_write32(SRAM_IOCTRL_REG, 0x03);
-    sdio_bak_write32(SRAM_RESETCTRL_REG, 0x00);
-    sdio_bak_write32(SRAM_IOCTRL_REG, 0x01);
-    if (!sdio_bak_read32(SRAM_IOCTRL_REG, &u32d.uint32) || u32d.uint8!=1)
-        disp_log_break();
-    // [18.034039]
-    sdio_bak_write32(SRAM_BANKX_IDX_REG, 0x03);
-    sdio_bak_write32(SRAM_BANKX_PDA_REG, 0x00);
-    // [18.034733]
-    if (!sdio_bak_read32(SRAM_IOCTRL_REG, &u32d.uint32) || u32d.uint8!=1)
-        disp_log_break();
-    if (!sdio_bak_read32(SRAM_RESETCTRL_REG, &u32d.uint32) || u32d.uint8!=0)
-        disp_log_break();
-    // [18.035416]
-    sdio_bak_read32(SRAM_BASE_ADDR, &u32d.uint32);
-    sdio_bak_write32(SRAM_BANKX_IDX_REG, 0);
-    sdio_bak_read32(SRAM_UNKNOWN_REG, &u32d.uint32);
-    sdio_bak_write32(SRAM_BANKX_IDX_REG, 1);
-    sdio_bak_read32(SRAM_UNKNOWN_REG, &u32d.uint32);
-    sdio_bak_write32(SRAM_BANKX_IDX_REG, 2);
-    sdio_bak_read32(SRAM_UNKNOWN_REG, &u32d.uint32);
-    sdio_bak_write32(SRAM_BANKX_IDX_REG, 3);
-    // [18.037502]
-    if (!sdio_cmd52_reads_check(SD_FUNC_BUS, 0x00f1, 0xff, 1, 1))
-        disp_log_break();
-    sdio_cmd52_writes(SD_FUNC_BUS, 0x00f1, 3, 1);
-    sdio_cmd53_read(SD_FUNC_BAK, 0x8600, u32d.bytes, 4);
-    u32d.bytes[1] |= 0x40;
-    sdio_cmd53_write(SD_FUNC_BAK, 0x8600, u32d.bytes, 4);
-    // [18.052762]
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_IOEN_REG, 1<<SD_FUNC_BAK, 1);
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0, 1);
-    usdelay(45000);
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 8, 1);
-    if (!sdio_cmd52_reads_check(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0xff, 0x48, 1))
-        disp_log_break();
-    // [18.100946] Load firmware
-    write_firmware();
-    sdio_bak_window(0x58000);
-    sdio_cmd53_read(SD_FUNC_BAK, 0xee80, data, 4);
-    // [19.143195] Load config data
-    write_nvram();
-    sdio_cmd53_read(SD_FUNC_BAK, 0xffd4, data, 44);
-    // [19.146150]
-    sdio_bak_read32(SRAM_IOCTRL_REG, &u32d.uint32); 
-    sdio_bak_read32(SRAM_RESETCTRL_REG, &u32d.uint32); 
-    sdio_bak_write32(SB_INT_STATUS_REG, 0xffffffff);
-    // [19.147404]
-    sdio_bak_write32(ARM_IOCTRL_REG, 0x03);
-    sdio_bak_write32(ARM_RESETCTRL_REG, 0x00);
-    sdio_bak_write32(ARM_IOCTRL_REG, 0x01);
-    sdio_bak_read32(ARM_IOCTRL_REG, &u32d.uint32);
-    sdio_bak_window(BAK_BASE_ADDR);
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0, 1);
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0x10, 1);
-    sdio_cmd52_reads(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, &u32d.uint32, 1);
-    usdelay(50000);
-    if (!sdio_cmd52_reads(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, &u32d.uint32, 1) || u32d.uint8!=0xd0)
-        disp_log_break();
-    // [19.190728]
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0xd2, 1);
-    sdio_bak_write32(SB_TO_SB_MBOX_DATA_REG, 0x40000);
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_IOEN_REG, (1<<SD_FUNC_BAK) | (1<<SD_FUNC_RAD), 1);
-    sdio_cmd52_reads(SD_FUNC_BUS, BUS_IORDY_REG, &u32d.uint32, 1);
-    usdelay(100000);
-    if (!sdio_cmd52_reads(SD_FUNC_BUS, BUS_IORDY_REG, &u32d.uint32, 1) || u32d.uint8!=0x06)
-        disp_log_break();
-    sdio_bak_write32(SB_INT_HOST_MASK_REG, 0x200000f0);
-    sdio_bak_read32(SR_CONTROL1, &u32d.uint32);
-    // [19.282972]
-    sdio_bak_window(BAK_BASE_ADDR);
-    sdio_cmd52_writes(SD_FUNC_BAK, BAK_WAKEUP_REG, 2, 1);
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_BRCM_CARDCAP, 6, 1);
-    sdio_cmd52_writes(SD_FUNC_BUS, BUS_INTEN_REG, 0x07, 1);
-    sdio_cmd52_reads(SD_FUNC_BUS, BUS_INTPEND_REG, &u32d.uint32, 1);
-    // [19.284023]
-    sdio_bak_read32(SB_INT_STATUS_REG, &u32d.uint32);
-    sdio_bak_write32(SB_INT_STATUS_REG, 0x200000c0);
-    sdio_bak_read32(SB_TO_HOST_MBOX_DATA_REG, &u32d.uint32);
-    sdio_bak_write32(SB_TO_SB_MBOX_REG, 0x02);
-    sdio_bak_read32(SR_CONTROL1, &u32d.uint32);
-    // [19.285708]
-    sdio_bak_read32(0x68000 | 0x7ffc, &u32d.uint32);
-    sdio_bak_window(0x38000);
-    sdio_cmd53_read(SD_FUNC_BAK, 0x70d4, data, 64);
-    // [19.286520]
-    sdio_bak_read32(SB_INT_STATUS_REG, &u32d.uint32);
-    sdio_bak_write32(SB_INT_STATUS_REG, 0x80);
-    sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, data, 64);
-    return(rca);
-}
-
-// Functions to access firmware image
-// Open for reading
-void firm_open_read(int addr)
-{
-#if INCLUDE_FIRMWARE
-    firmware_pos = addr;
-#else
-    flash_open_read(addr);
-#endif
-}
-// Read n bytes
-void firm_read(uint8_t *dp, int len)
-{
-#if INCLUDE_FIRMWARE
-    memcpy(dp, &firmware_bin[firmware_pos], len);
-    firmware_pos += len;
-#else
-    flash_read(dp, len);
-#endif
-}
-// Close
-void firm_close(void)
-{
-#if !INCLUDE_FIRMWARE
-    flash_close();
-#endif
-}
-
-// Upload blocks of firmware from flash to chip RAM
-int write_firmware(void)
-{
-    int len, n=0, nbytes=0, nblocks;
-    uint32_t addr;
-
-    firm_open_read(0);
-    while (nbytes < FIRMWARE_LEN)
-    {
-        addr = sdio_bak_addr(nbytes);
-        len = MIN(sizeof(txbuffer), FIRMWARE_LEN-nbytes);
-        nblocks = len / SD_BAK_BLK_BYTES;
-		if (nblocks > 0)
-        {
-            firm_read(txbuffer, nblocks*SD_BAK_BLK_BYTES);
-            n = sdio_write_blocks(SD_FUNC_BAK, SB_32BIT_WIN+addr, txbuffer, nblocks);
-            if (!n)
-                break;
-            nbytes += nblocks * SD_BAK_BLK_BYTES;
-        }
-        else
-        {
-            firm_read(txbuffer, len);
-            sdio_cmd53_write(SD_FUNC_BAK, SB_32BIT_WIN+addr, txbuffer, len);
-            nbytes += len;
-        }
-    }
-    firm_close();
-    return(nbytes);
-}
-
-// Upload blocks of config data to chip NVRAM
-int write_nvram(void)
-{
-    int nbytes=0, len;
-
-    sdio_bak_window(0x078000);
-    while (nbytes < config_len)
-    {
-        len = MIN(config_len-nbytes, SD_BAK_BLK_BYTES);
-        sdio_cmd53_write(SD_FUNC_BAK, 0xfd54+nbytes, &config_data[nbytes], len);
-        nbytes += len;
-    }
-    return(nbytes);
-}
-
-// Set up SD interface
-void sd_setup(void)
-{
-    gpio_set(SD_CLK_PIN, GPIO_OUT, GPIO_NOPULL);
-    gpio_set(SD_CMD_PIN, GPIO_IN, GPIO_PULLUP);
-    gpio_set(SD_D0_PIN, GPIO_IN, GPIO_PULLUP);
-    gpio_set(SD_D1_PIN, GPIO_IN, GPIO_PULLUP);
-    gpio_set(SD_D2_PIN, GPIO_IN, GPIO_PULLUP);
-    gpio_set(SD_D3_PIN, GPIO_IN, GPIO_PULLUP);
-}
-
-#if INCLUDE_FIRMWARE
-#include FIRMWARE_FNAME
-#endif
 // EOF
 
@@ -0,0 +1,499 @@
+// ZeroWi bare-metal WiFi driver, see https://iosoft.blog/zerowi
+// Host benchmark, using the in-memory chip model as SDIO transport
+//
+// Copyright (c) 2020 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define VERSION "0.76"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "whd_types.h"
+#include "whd_wlioctl.h"
+#include "whd_events.h"
+
+#include "zw_gpio.h"
+#include "zw_crc.h"
+#include "zw_sdio.h"
+#include "zw_regs.h"
+#include "zw_ioctl.h"
+#include "zw_sim.h"
+#include "zw_init.h"
+
+// Number of IOCTL round-trips, and event bursts
+#define SIM_IOCTLS      100
+#define SIM_SCANS       10
+
+// Backplane addresses in 2 different windows, for batch test
+#define SIM_WIN_A       0x10000
+#define SIM_WIN_B       0x20000
+
+// Size and number of data blocks for CRC test
+#define SIM_BLK_BYTES   512
+#define SIM_BLKS        2000
+
+// Chip RAM address to corrupt, for firmware verify test
+#define SIM_BAD_ADDR    0x12345
+
+// Size and number of buffers for output test, long enough that the
+// idle clocks around each one are negligible
+#define SIM_OUT_BYTES   0x10000
+#define SIM_OUTS        20
+
+// Firmware response time for latency test
+#define SIM_RESP_USEC   100
+
+uint8_t outbuff[SIM_OUT_BYTES];
+
+EVT_STR escan_evts[]=ESCAN_EVTS;
+
+// Compressed firmware image from firm_lz4.py, and uncompressed original
+extern const unsigned char firmware_lz4[];
+#include "../firmware/brcmfmac43430-sdio.c"
+
+// Malformed LZ4 blocks, with their lengths, should all be rejected
+uint8_t lz4_bad[][8] = {
+    {0xf0},                         // Literal length extension missing
+    {0x50, 'a', 'b'},               // Literals past end of block
+    {0x10, 'a', 0x01},              // Match offset truncated
+    {0x10, 'a', 0x02, 0x00, 0x00},  // Match before start of output
+    {0x10, 'a', 0x00, 0x00, 0x00},  // Zero match offset
+    {0x1f, 'a', 0x01, 0x00}};       // Match length extension missing
+int lz4_bad_lens[] = {1, 3, 3, 5, 5, 4};
+#define LZ4_NBAD (sizeof(lz4_bad_lens) / sizeof(int))
+
+// Valid block, decodes to 5 bytes "aaaaa"
+uint8_t lz4_good[] = {0x10, 'a', 0x01, 0x00};
+
+int check_fails, poll_count, irq_count, evt_count, evt_errors, req_count;
+
+// Transport with failing CMD53 writes
+SDIO_TRANSPORT fail_bus;
+
+void disp_bench(char *name, int usec, int count);
+void check(char *name, int ok);
+int bak_batch_test(int gap);
+int lz4_test(void);
+int profile_test(void);
+void poll_hook(void);
+void nibble_block_out(uint8_t *dp, int nbytes);
+uint64_t nibble_qcrc(uint64_t crc, uint8_t *dp, int nbytes);
+void irq_callback(void);
+void req_callback(IOCTL_REQ *req);
+int fail_write(int func, int addr, uint8_t *dp, int nbytes);
+void escan_event(struct whd_event_msg *msg, uint8_t *data, int dlen);
+
+int main(void)
+{
+    int n, i, count, t, startime;
+    uint64_t crc, crc2;
+    IOCTL_POLICY policies[2] = {{0, IOCTL_WAIT_USEC, IOCTL_WAIT_USEC},
+                                {IOCTL_SPIN_USEC, IOCTL_BACKOFF_MIN, IOCTL_BACKOFF_MAX}};
+    uint8_t resp[256] = {0}, blk[SIM_BLK_BYTES];
+    EVT_SLOT *sp;
+
+    mmap_init();
+    crc7_init();
+    qcrc16r_init();
+    crc32_init();
+    dout_init();
+    sim_init();
+    sdio_set_transport(&sdio_sim);
+    printf("\nZerowi simulation test v" VERSION "\n");
+    check("LZ4 decode", lz4_test());
+    check("Pin-mux profiles", profile_test());
+    // Data output to simulated GPIO, table-driven against nibble-at-a-time,
+    // with no half-period delay
+    sdio_set_clk_ns(0);
+    for (n=0; n<SIM_OUT_BYTES; n++)
+        outbuff[n] = (uint8_t)rand();
+    for (n=0; n<SIM_BLK_BYTES; n++)
+        blk[n] = outbuff[n];
+    t = ustime();
+    for (n=0; n<SIM_OUTS; n++)
+        sdio_block_out(outbuff, SIM_OUT_BYTES);
+    t = ustime() - t;
+    startime = ustime();
+    for (n=0; n<SIM_OUTS; n++)
+        nibble_block_out(outbuff, SIM_OUT_BYTES);
+    startime = ustime() - startime;
+    printf("Block output: table %d nsec/byte, nibble %d nsec/byte\n",
+           t * 1000 / (SIM_OUTS * SIM_OUT_BYTES), startime * 1000 / (SIM_OUTS * SIM_OUT_BYTES));
+    // Poll hook is called every 16 bytes, whatever the buffer alignment
+    sdio_poll_hook = poll_hook;
+    for (n=count=0; n<4; n++)
+    {
+        poll_count = 0;
+        sdio_block_out(&outbuff[n], 64);
+        count += poll_count == 4;
+    }
+    sdio_poll_hook = 0;
+    check("Poll hook", count == 4);
+    // Data CRC: slice-by-4 must match nibble-at-a-time, for all alignments
+    for (n=count=0; n<SIM_BLK_BYTES; n++)
+    {
+        i = (SIM_BLK_BYTES - 4) / 4 * (n % 4) + n / 4;
+        count += qcrc16r_data(n, &blk[n%4], i) != nibble_qcrc(n, &blk[n%4], i);
+    }
+    t = ustime();
+    for (n=0, crc=0; n<SIM_BLKS; n++)
+        crc = qcrc16r_data(crc, blk, SIM_BLK_BYTES);
+    t = ustime() - t;
+    startime = ustime();
+    for (n=0, crc2=0; n<SIM_BLKS; n++)
+        crc2 = nibble_qcrc(crc2, blk, SIM_BLK_BYTES);
+    startime = ustime() - startime;
+    printf("Data CRC: %d mismatches%s, slice-by-4 %d Mbyte/s, nibble %d Mbyte/s\n", count,
+           crc != crc2 ? " (throughput test)" : "", SIM_BLKS * SIM_BLK_BYTES / MAX(t, 1),
+           SIM_BLKS * SIM_BLK_BYTES / MAX(startime, 1));
+    // Chip initialisation, including firmware download
+    startime = ustime();
+    bak_xfers = bak_wins = 0;
+    n = sdio_init() != 0;
+    printf("Init: %d backplane transfers, %d window changes\n", bak_xfers, bak_wins);
+    disp_bench(init_warm ? "Warm init" : "Init", ustime()-startime, n);
+    if (ioctl_wr_int32(WLC_UP, 200, 0))
+        printf("Boot to WLC_UP %d usec\n", ustime()-startime);
+    // Host restart with chip still powered, should skip firmware download
+    t = ustime();
+    n = sdio_init() != 0;
+    disp_bench(init_warm ? "Warm init" : "Init", ustime()-t, n);
+    check("Warm init", init_warm);
+    // Firmware fingerprint mismatch, should fall back to a cold start,
+    // after which the next restart should be warm again
+    sim_ram[FIRM_FPRINT_ADDR] ^= 0xff;
+    t = ustime();
+    n = sdio_init() != 0;
+    disp_bench(init_warm ? "Warm init" : "Init", ustime()-t, n);
+    n = n && !init_warm && sdio_init() && init_warm;
+    check("Fingerprint mismatch", n);
+    // Firmware readback, should find first bad block after RAM is corrupted
+    n = verify_firmware() && firm_find_error() < 0;
+    sim_ram[SIM_BAD_ADDR] ^= 0xff;
+    sim_ram[SIM_BAD_ADDR + 0x1000] ^= 0xff;
+    n = n && !verify_firmware() && firm_find_error() == (SIM_BAD_ADDR & ~(SD_BAK_BLK_BYTES-1));
+    sim_ram[SIM_BAD_ADDR] ^= 0xff;
+    sim_ram[SIM_BAD_ADDR + 0x1000] ^= 0xff;
+    check("Firmware verify", n);
+    // Backplane batch, with contiguous writes (merged) and gaps (not merged)
+    check("Backplane batch", bak_batch_test(0) && bak_batch_test(4));
+    // Contiguous writes either side of a sync are not merged
+    bak_xfers = 0;
+    bak_batch_start();
+    bak_queue_write(SIM_WIN_A, 0, 4);
+    bak_queue_sync();
+    bak_queue_write(SIM_WIN_A+4, 0, 4);
+    check("Backplane sync", bak_batch_run() == 2 && bak_xfers == 2);
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    // IOCTL round trips
+    t = ustime();
+    for (n=count=0; n<SIM_IOCTLS; n++)
+        count += ioctl_get_data("ver", 0, resp, sizeof(resp)) > 0;
+    // Response read directly on D1: header & 2 data reads, no status read
+    n = sim_stats.cmd53_reads == SIM_IOCTLS * 3;
+    disp_bench("IOCTL", ustime()-t, count);
+    check("Direct IOCTL reads", n);
+    printf("Firmware %s\n", resp);
+    // IOCTL latency with delayed firmware response, fixed poll then adaptive
+    sim_resp_usec = SIM_RESP_USEC;
+    for (i=0; i<2; i++)
+    {
+        ioctl_stats_clear();
+        t = ustime();
+        for (n=count=0; n<SIM_IOCTLS; n++)
+            count += ioctl_cmd_policy(WLC_GET_VAR, "ver", 0, 0, resp, sizeof(resp),
+                                      &policies[i]) > 0;
+        disp_bench(i ? "Adaptive IOCTL" : "Fixed poll IOCTL", ustime()-t, count);
+        ioctl_disp_stats();
+    }
+    sim_resp_usec = 0;
+    // Asynchronous IOCTLs, all in flight together
+    t = ustime();
+    for (n=count=0; n<SIM_IOCTLS; n++)
+    {
+        while (ioctl_submit(WLC_GET_VAR, "ver", 0, 0, resp, sizeof(resp), req_callback))
+            count++;
+        while (ioctl_poll())
+            ioctl_wait(IOCTL_WAIT_USEC);
+    }
+    disp_bench("Async IOCTL", ustime()-t, req_count);
+    printf("Submitted %d, %d per batch\n", count, count / SIM_IOCTLS);
+    // Failed write with callback frees the request, so submit should return null
+    fail_bus = sdio_sim;
+    fail_bus.cmd53_write = fail_write;
+    sdio_set_transport(&fail_bus);
+    n = ioctl_submit(WLC_GET_VAR, "ver", 0, 0, resp, sizeof(resp), req_callback) == 0;
+    sdio_set_transport(&sdio_sim);
+    check("Failed submit", n && ioctl_pending == 0);
+    // Batched IOCTLs, back-to-back then glommed
+    for (n=0; n<2; n++)
+    {
+        if (n && !ioctl_glom_enable(1))
+            printf("Glom not enabled\n");
+        memset(&sim_stats, 0, sizeof(sim_stats));
+        t = ustime();
+        ioctl_batch_start();
+        while (ioctl_batch_set_intx2("bsscfg:sup_wpa", 0, 1) >= 0) ;
+        count = ioctl_batch_run(0);
+        printf("%d subframes glommed, ", sim_stats.glom_subframes);
+        disp_bench(n ? "Glom batch" : "Batch", ustime()-t, count);
+    }
+    // Command too long for an IOCTL message should be rejected
+    ioctl_batch_start();
+    n = ioctl_batch_add(WLC_SET_VAR, "bsscfg:sup_wpa", 1, resp, IOCTL_MAX_BLKLEN) < 0 &&
+        !ioctl_submit(WLC_SET_VAR, "bsscfg:sup_wpa", 0, 1, resp, IOCTL_MAX_BLKLEN, 0);
+    check("Oversize IOCTL", n);
+    ioctl_glom_enable(0);
+    // Event draining through queue, only when interrupt from chip,
+    // or frames may be left in chip
+    ioctl_subscribe_evts(escan_evts);
+    ioctl_evt_register(WLC_E_ESCAN_RESULT, escan_event);
+    sdio_irq_init(irq_callback);
+    t = ustime();
+    for (n=count=0; n<SIM_SCANS; n++)
+    {
+        ioctl_set_data("escan", 0, resp, sizeof(resp)/2);
+        sdio_irq_arm();
+        while (sdio_irq_flag || evtq.more)
+        {
+            ioctl_irq_ack();
+            evtq_receive();
+            sdio_irq_arm();
+            while ((sp = evtq_get()) != 0)
+            {
+                count += ioctl_evt_dispatch(sp);
+                evtq_release();
+            }
+        }
+    }
+    disp_bench("Event", ustime()-t, count);
+    printf("Event queue %u frames, %u full, %u dropped, %u lost; %d handled, %d errors\n",
+           evtq.frames, evtq.full, evtq.drops, evtq.lost, evt_count, evt_errors);
+    check("Event dispatch", count > 0 && evt_count == count && !evt_errors);
+    // Overlapping subscription, then removal, shouldn't change the mask
+    ioctl_subscribe_evts(escan_evts);
+    ioctl_unsubscribe_evts(escan_evts);
+    t = sim_evt_mask[WLC_E_ESCAN_RESULT/8] & (1 << (WLC_E_ESCAN_RESULT & 7));
+    printf("Event subscriptions: %d IOCTLs avoided, escan %s\n", event_ioctls_avoided,
+           t ? "enabled" : "disabled");
+    check("Event subscriptions", event_ioctls_avoided == 2 && t);
+    // Unsolicited event while idle, should interrupt on falling edge
+    // (no timer interrupt on host, so idle clock falls back to wait mode)
+    n = sdio_idle_mode(SD_IDLE_TIMER);
+    printf("Idle clock %s, ", n==SD_IDLE_TIMER ? "timer" : n==SD_IDLE_WAIT ? "wait" : "continuous");
+    sdio_irq_arm();
+    n = irq_count;
+    t = sdio_idle_wait(100);
+    sim_event(WLC_E_ESCAN_RESULT, WLC_E_STATUS_SUCCESS, 0);
+    n = !t && sdio_idle_wait(100) && irq_count > n;
+    printf("interrupts %d\n", irq_count);
+    check("Idle event interrupt", n);
+    // Interrupt should stay asserted after the frame is read, until acknowledged
+    n = evtq_receive() == 1 && sdio_irq();
+    ioctl_irq_ack();
+    check("Interrupt acknowledge", n && !sdio_irq());
+    evtq_release();
+    // Any bus transaction should disarm, so the idle clock timer can't toggle CLK
+    sdio_irq_arm();
+    n = sdio_irq_armed;
+    ioctl_irq_ack();
+    check("Transaction disarm", n && !sdio_irq_armed);
+    printf("%d checks failed\n", check_fails);
+    return(check_fails != 0);
+}
+
+// Backplane batch: writes interleaved between 2 windows should be grouped,
+// so the window only changes once, and contiguous writes in a window merged
+// Read back the values, return non-zero if all OK
+int bak_batch_test(int gap)
+{
+    uint32_t addrs[4]={SIM_WIN_A, SIM_WIN_B, SIM_WIN_A+4+gap, SIM_WIN_B+4+gap};
+    int n, ok, idx[4];
+
+    sdio_bak_window(SIM_WIN_A);
+    bak_xfers = bak_wins = 0;
+    bak_batch_start();
+    for (n=0; n<4; n++)
+        bak_queue_write(addrs[n], 0x11111111 * (n + 1) + gap, 4);
+    ok = bak_batch_run() == 4;
+    printf("Backplane batch%s: %d transfers, %d window changes\n",
+           gap ? " with gaps" : "", bak_xfers, bak_wins);
+    ok = ok && bak_wins == 1 && bak_xfers == (gap ? 4 : 2);
+    bak_batch_start();
+    for (n=0; n<4; n++)
+        idx[n] = bak_queue_read(addrs[n], 4);
+    ok = bak_batch_run() == 4 && ok;
+    for (n=0; n<4; n++)
+        ok = ok && bak_result(idx[n]) == 0x11111111 * (n + 1) + gap;
+    return(ok);
+}
+
+// Decode the compressed firmware, and compare it with the original image;
+// check that malformed blocks, output overflow and oversized raw blocks
+// are rejected. Return non-zero if all OK
+int lz4_test(void)
+{
+    static uint8_t buff[FIRM_LZ4_BLOCK];
+    const uint8_t *src=firmware_lz4;
+    int n, hdr, len=0, nbad=0, ok=1, t=ustime();
+
+    while (ok && (hdr = src[0] | src[1] << 8) != 0)
+    {
+        n = lz4_block_decode(src+2, hdr, buff, sizeof(buff));
+        ok = n > 0 && len+n <= FIRMWARE_LEN && !memcmp(buff, &firmware_bin[len], n);
+        len += n;
+        src += (hdr & ~FIRM_LZ4_RAW) + 2;
+    }
+    t = ustime() - t;
+    for (n=0; n<LZ4_NBAD; n++)
+        nbad += lz4_block_decode(lz4_bad[n], lz4_bad_lens[n], buff, sizeof(buff)) < 0;
+    nbad += lz4_block_decode(lz4_good, sizeof(lz4_good), buff, 4) < 0;
+    nbad += lz4_block_decode(lz4_good, FIRM_LZ4_RAW | 10, buff, 8) < 0;
+    printf("LZ4 decode: %d bytes in %d usec, %s, %d of %d bad blocks rejected\n",
+           len, t, ok ? "matched" : "mismatch", nbad, (int)LZ4_NBAD + 2);
+    return(ok && len==FIRMWARE_LEN && nbad==LZ4_NBAD+2 &&
+           lz4_block_decode(lz4_good, sizeof(lz4_good), buff, 5) == 5 && !memcmp(buff, "aaaaa", 5));
+}
+
+// Pin-mux profiles should give the same GPFSEL value as setting the pins
+// one at a time, leaving the other pins in the register unchanged
+// Return non-zero if all OK
+int profile_test(void)
+{
+    GPIO_PROFILE *profs[4] = {&sd_data_out, &sd_data_in, &sd_cmd_out, &sd_cmd_in};
+    int pins[4] = {SD_D0_PIN, SD_D0_PIN, SD_CMD_PIN, SD_CMD_PIN};
+    int npins[4] = {SD_DATA_PINS, SD_DATA_PINS, 1, 1};
+    int modes[4] = {GPIO_OUT, GPIO_IN, GPIO_OUT, GPIO_IN};
+    int i, n, reg, ok=1;
+    uint32_t *regp, save, val;
+
+    for (i=0; i<4; i++)
+    {
+        reg = profs[i]->reg;
+        regp = GPIO_REG(GPIO_MODE0) + reg;
+        save = *regp;
+        // Other pins in the register set to various alternate functions
+        for (n=0; n<10; n++)
+            gpio_mode(reg*10 + n, (n + i) % 8);
+        for (n=0; n<npins[i]; n++)
+            gpio_mode(pins[i] + n, modes[i]);
+        val = *regp;
+        for (n=0; n<10; n++)
+            gpio_mode(reg*10 + n, (n + i) % 8);
+        gpio_profile_set(profs[i]);
+        ok = ok && *regp == val && gpio_fsel[reg] == val && reg == pins[i] / 10;
+        *regp = gpio_fsel[reg] = save;
+    }
+    return(ok);
+}
+
+// Poll hook for data block output, count calls
+void poll_hook(void)
+{
+    poll_count++;
+}
+
+// Display check result, and count failures
+void check(char *name, int ok)
+{
+    printf("%s %s\n", name, ok ? "OK" : "FAILED");
+    check_fails += !ok;
+}
+
+// Nibble-at-a-time data block output with CRC, as used before the data
+// output table, for comparison: 8 GPIO stores & 6 calls per byte, against 6 stores
+void nibble_block_out(uint8_t *dp, int nbytes)
+{
+    uint64_t qcrc=0;
+    uint8_t d;
+    int n;
+
+    clk_0(1);
+    gpio_write(SD_D0_PIN, 4, 0);
+    clk_0(1);
+    for (n=0; n<nbytes*2; n++)
+    {
+        d = n & 1 ? dp[n/2] & 0xf : dp[n/2] >> 4;
+        gpio_write(SD_D0_PIN, 4, d);
+        gpio_out(SD_CLK_PIN, 1);
+        QCRC_NIBBLE(qcrc, d);
+        gpio_out(SD_CLK_PIN, 0);
+    }
+    for (n=0; n<16; n++)
+    {
+        gpio_write(SD_D0_PIN, 4, (uint8_t)qcrc & 0xf);
+        gpio_out(SD_CLK_PIN, 1);
+        qcrc >>= 4;
+        gpio_out(SD_CLK_PIN, 0);
+    }
+    gpio_write(SD_D0_PIN, 4, 0xf);
+    clk_0(1);
+}
+
+// Nibble-at-a-time data CRC, m.s.nibble first, for comparison
+uint64_t nibble_qcrc(uint64_t crc, uint8_t *dp, int nbytes)
+{
+    while (nbytes-- > 0)
+    {
+        QCRC_NIBBLE(crc, *dp >> 4);
+        QCRC_NIBBLE(crc, *dp & 0xf);
+        dp++;
+    }
+    return(crc);
+}
+
+// Escan event handler, check byte-swapped message
+void escan_event(struct whd_event_msg *msg, uint8_t *data, int dlen)
+{
+    evt_count++;
+    if (msg->event_type != WLC_E_ESCAN_RESULT || msg->datalen != dlen ||
+        (msg->status != WLC_E_STATUS_PARTIAL && msg->status != WLC_E_STATUS_SUCCESS))
+        evt_errors++;
+}
+
+// Asynchronous IOCTL completion callback
+void req_callback(IOCTL_REQ *req)
+{
+    req_count += req->status == IOCTL_DONE;
+}
+
+// CMD53 write that always fails
+int fail_write(int func, int addr, uint8_t *dp, int nbytes)
+{
+    return(-1);
+}
+
+// Interrupt callback
+void irq_callback(void)
+{
+    irq_count++;
+}
+
+// Display benchmark result, and transaction counts
+void disp_bench(char *name, int usec, int count)
+{
+    printf("%s: %d in %d usec, ", name, count, usec);
+    sim_disp_stats();
+    memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+// Dummy function to trigger debug breakpoint
+void gdb_break(void)
+{
+}
+
+// EOF
@@ -0,0 +1,181 @@
+// ZeroWi bare-metal WiFi driver, see https://iosoft.blog/zerowi
+// SDIO CRC calculations
+//
+// Copyright (c) 2020 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+
+#include "zw_crc.h"
+
+// CRC tables
+uint64_t qcrc16r_poly, qcrc16r_table[16], qcrc16r_slice[QCRC_SLICES][256];
+uint8_t crc7_table[256];
+uint32_t crc32_slice[4][256];
+
+// Initialise CRC7 calculator
+void crc7_init(void)
+{
+    int i;
+
+    for (i=0; i<256; i++)
+        crc7_table[i] = crc7_byte(i);
+}
+
+// Calculate 7-bit CRC of byte, return as bits 1-7
+uint8_t crc7_byte(uint8_t b)
+{
+    uint16_t n, w=b;
+
+    for (n=0; n<8; n++)
+    {
+        w <<= 1;
+        if (w & 0x100)
+            w ^= CRC7_POLY;
+    }
+    return((uint8_t)w);
+}
+
+// Calculate 7-bit CRC of data bytes, with l.s.bit as stop bit
+uint8_t crc7_data(uint8_t *data, int n)
+{
+    uint8_t crc=0;
+
+    while (n--)
+        crc = crc7_table[crc ^ *data++];
+    return(crc | 1);
+}
+
+// Initialise bit-reversed CRC16 lookup tables for 4-bit values,
+// and slice-by-4 tables for bytes & words
+void qcrc16r_init(void)
+{
+    uint64_t crc;
+    int i, n;
+
+    qcrc16r_poly = quadval(CRC16R_POLY);
+    for (i=0; i<16; i++)
+        qcrc16r_table[i]  = (i & 8 ? qcrc16r_poly<<3 : 0) |
+                            (i & 4 ? qcrc16r_poly<<2 : 0) |
+                            (i & 2 ? qcrc16r_poly<<1 : 0) |
+                            (i & 1 ? qcrc16r_poly<<0 : 0);
+    // Byte table, indexed by 1st nibble in l.s.bits, 2nd in m.s.bits
+    for (i=0; i<256; i++)
+    {
+        crc = qcrc16r_table[i & 0xf];
+        QCRC_NIBBLE(crc, i >> 4);
+        qcrc16r_slice[0][i] = crc;
+    }
+    // Each slice is the previous one followed by a zero byte
+    for (n=1; n<QCRC_SLICES; n++)
+    {
+        for (i=0; i<256; i++)
+        {
+            crc = qcrc16r_slice[n-1][i];
+            qcrc16r_slice[n][i] = crc >> 8 ^ qcrc16r_slice[0][(uint8_t)crc];
+        }
+    }
+}
+
+// Update CRC with a block of data, using 32-bit words where possible
+uint64_t qcrc16r_data(uint64_t crc, uint8_t *dp, int nbytes)
+{
+    uint32_t *wp;
+
+    while (nbytes > 0 && ((uintptr_t)dp & 3))
+    {
+        QCRC_BYTE(crc, *dp);
+        dp++;
+        nbytes--;
+    }
+    wp = (uint32_t *)dp;
+    while (nbytes >= 4)
+    {
+        QCRC_WORD(crc, *wp);
+        wp++;
+        nbytes -= 4;
+    }
+    dp = (uint8_t *)wp;
+    while (nbytes-- > 0)
+    {
+        QCRC_BYTE(crc, *dp);
+        dp++;
+    }
+    return(crc);
+}
+
+// Initialise slice-by-4 tables for bit-reversed CRC32 (as used by zlib)
+void crc32_init(void)
+{
+    uint32_t crc;
+    int i, n;
+
+    for (i=0; i<256; i++)
+    {
+        crc = i;
+        for (n=0; n<8; n++)
+            crc = crc & 1 ? crc >> 1 ^ CRC32R_POLY : crc >> 1;
+        crc32_slice[0][i] = crc;
+    }
+    for (n=1; n<4; n++)
+    {
+        for (i=0; i<256; i++)
+        {
+            crc = crc32_slice[n-1][i];
+            crc32_slice[n][i] = crc >> 8 ^ crc32_slice[0][(uint8_t)crc];
+        }
+    }
+}
+
+// Update CRC32 with a block of data, starting with zero
+// Can be called repeatedly, to calculate the CRC of successive blocks
+uint32_t crc32_data(uint32_t crc, uint8_t *dp, int nbytes)
+{
+    uint32_t *wp;
+
+    crc = ~crc;
+    while (nbytes > 0 && ((uintptr_t)dp & 3))
+    {
+        CRC32_BYTE(crc, *dp);
+        dp++;
+        nbytes--;
+    }
+    wp = (uint32_t *)dp;
+    while (nbytes >= 4)
+    {
+        CRC32_WORD(crc, *wp);
+        wp++;
+        nbytes -= 4;
+    }
+    dp = (uint8_t *)wp;
+    while (nbytes-- > 0)
+    {
+        CRC32_BYTE(crc, *dp);
+        dp++;
+    }
+    return(~crc);
+}
+
+// Spread a 16-bit value to occupy 64 bits
+uint64_t quadval(uint16_t val)
+{
+    uint64_t ret=0;
+    int i;
+
+    for (i=0; i<16; i++)
+        ret |= val & (1<<i) ? 1LL<<(i*4) : 0;
+    return(ret);
+}
+
+// EOF
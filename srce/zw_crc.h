@@ -0,0 +1,62 @@
+// ZeroWi bare-metal WiFi driver, see https://iosoft.blog/zerowi
+// SDIO CRC definitions
+//
+// Copyright (c) 2020 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// CRC polynomials
+#define CRC7_POLY    (uint8_t)(0b10001001 << 1)
+#define CRC16R_POLY  (1<<(15-0) | 1<<(15-5) | 1<<(15-12))
+#define CRC32R_POLY  0xedb88320
+
+// The 4-line data CRC is held as 4 interleaved 16-bit CRCs in 64 bits
+// (see quadval), one CRC per data line. A data byte is sent as 2 nibbles,
+// m.s.nibble first, so is nibble-swapped before being used as an index.
+#define QCRC_SLICES     4
+#define NIBSWAP8(b)     ((uint8_t)((b) >> 4 | (b) << 4))
+#define NIBSWAP32(w)    (((w) >> 4 & 0x0f0f0f0f) | ((w) << 4 & 0xf0f0f0f0))
+
+// Update CRC with one data nibble
+#define QCRC_NIBBLE(crc, d) crc = crc >> 4 ^ \
+    qcrc16r_table[((d) ^ (uint8_t)crc) & 0xf]
+
+// Update CRC with one data byte
+#define QCRC_BYTE(crc, b) crc = crc >> 8 ^ \
+    qcrc16r_slice[0][NIBSWAP8(b) ^ (uint8_t)crc]
+
+// Update CRC with a 32-bit word of data, l.s.byte first
+#define QCRC_WORD(crc, w) {uint32_t _x = NIBSWAP32(w) ^ (uint32_t)crc; \
+    crc = crc >> 32 ^ qcrc16r_slice[3][_x & 0xff] ^ \
+        qcrc16r_slice[2][_x >> 8 & 0xff] ^ \
+        qcrc16r_slice[1][_x >> 16 & 0xff] ^ qcrc16r_slice[0][_x >> 24];}
+
+// Update bit-reversed CRC32 with one data byte, or 32-bit word
+#define CRC32_BYTE(crc, b) crc = crc >> 8 ^ crc32_slice[0][(uint8_t)(crc ^ (b))]
+#define CRC32_WORD(crc, w) {uint32_t _x = crc ^ (w); \
+    crc = crc32_slice[3][_x & 0xff] ^ crc32_slice[2][_x >> 8 & 0xff] ^ \
+        crc32_slice[1][_x >> 16 & 0xff] ^ crc32_slice[0][_x >> 24];}
+
+extern uint64_t qcrc16r_table[16], qcrc16r_slice[QCRC_SLICES][256];
+extern uint32_t crc32_slice[4][256];
+
+void crc7_init(void);
+uint8_t crc7_byte(uint8_t b);
+uint8_t crc7_data(uint8_t *data, int n);
+void qcrc16r_init(void);
+uint64_t qcrc16r_data(uint64_t crc, uint8_t *dp, int nbytes);
+uint64_t quadval(uint16_t val);
+void crc32_init(void);
+uint32_t crc32_data(uint32_t crc, uint8_t *dp, int nbytes);
+
+// EOF
@@ -16,6 +16,7 @@
 // limitations under the License.
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -28,35 +29,91 @@
 #if USE_MMAP
 #include <sys/mman.h>
 #endif
+#if USE_SIM
+#include <time.h>
+#endif
 
 #define PAGE_SIZE       0x1000
 
 #define USEC_BASE       (REG_BASE + 0x3000)
 #define USEC_SIZE       PAGE_SIZE
 
-#define GPIO_BASE       (REG_BASE + 0x200000)
-#define GPIO_SIZE       0x20000
-#define GPIO_MODE0      (uint32_t *)GPIO_BASE
-#define GPIO_SET0       (uint32_t *)(GPIO_BASE + 0x1c)
-#define GPIO_CLR0       (uint32_t *)(GPIO_BASE + 0x28)
-#define GPIO_LEV0       (uint32_t *)(GPIO_BASE + 0x34)
 #define GPIO_GPPUD      (uint32_t *)(GPIO_BASE + 0x94)
 #define GPIO_GPPUDCLK0  (uint32_t *)(GPIO_BASE + 0x98)
 
+#define PADS_BASE       (REG_BASE + 0x10002c)
+#define PADS_PASSWD     0x5a000000
+#define PADS_SLEW       (1 << 4)
+#define PADS_HYST       (1 << 3)
+
 #define SPI0_BASE       (REG_BASE + 0x204000)
 #define SPI0_CS         (uint32_t *)SPI0_BASE
 #define SPI0_FIFO       (uint32_t *)(SPI0_BASE + 0x04)
 #define SPI0_CLK        (uint32_t *)(SPI0_BASE + 0x08)
 #define SPI0_DLEN       (uint32_t *)(SPI0_BASE + 0x0c)
 #define SPI0_DC         (uint32_t *)(SPI0_BASE + 0x14)
+#define SPI0_CS_RXD     (1 << 17)
+#define SPI0_CS_TXD     (1 << 18)
+#define SPI0_CS_RXR     (1 << 19)
+#define SPI0_CS_DMAEN   (1 << 8)
+#define SPI0_FIFO_LEN   64
+#define SPI0_RXR_LEN    48
+
+// Flash read commands
+#define FLASH_CMD_READ      0x03
+#define FLASH_CMD_FASTREAD  0x0b
+
+// DMA controller, channels for SPI0 flash Tx and Rx
+#define DMA_BASE        (REG_BASE + 0x7000)
+#define DMA_CS(n)       (uint32_t *)(DMA_BASE + (n)*0x100)
+#define DMA_CONBLK(n)   (uint32_t *)(DMA_BASE + (n)*0x100 + 0x04)
+#define DMA_TXFR_LEN(n) (uint32_t *)(DMA_BASE + (n)*0x100 + 0x14)
+#define DMA_ENABLE      (uint32_t *)(DMA_BASE + 0xff0)
+#define DMA_CS_ACTIVE   (1 << 0)
+#define DMA_CS_END      (1 << 1)
+#define DMA_CS_ERROR    (1 << 8)
+#define DMA_CS_RESET    (1 << 31)
+#define DMA_TI_WAIT_RESP (1 << 3)
+#define DMA_TI_DEST_INC (1 << 4)
+#define DMA_TI_DEST_DREQ (1 << 6)
+#define DMA_TI_SRC_DREQ (1 << 10)
+#define DMA_TI_PERMAP(n) ((n) << 16)
+#define DMA_PERMAP_SPI_TX 6
+#define DMA_PERMAP_SPI_RX 7
+#define FLASH_DMA_TX    4
+#define FLASH_DMA_RX    5
+
+// DMA transfer sizes (SPI DLEN is 16 bits)
+#define FLASH_DMA_MIN   64
+#define FLASH_DMA_MAX   0xfffc
+
+// Data cache line size
+#define DCACHE_LINE     32
+
+// Bus addresses for DMA: peripherals, and RAM via the L2 cache alias
+// CPU access to DMA descriptors is via the uncached virtual alias
+#define BUS_PERIPH(a)   ((uint32_t)(uintptr_t)(a) - REG_BASE + 0x7e000000)
+#if REG_BASE == 0x20000000
+#define BUS_RAM(p)      ((uint32_t)(uintptr_t)(p) | 0x40000000)
+#else
+#define BUS_RAM(p)      ((uint32_t)(uintptr_t)(p) | 0xc0000000)
+#endif
+#define UNCACHED(p)     ((void *)((uintptr_t)(p) | 0x40000000))
+
+// DMA control block
+typedef struct {
+    uint32_t ti, srce_ad, dest_ad, txfr_len, stride, nextconbk, debug, unused;
+} DMA_CB;
 
 #if USE_MMAP
-#define GPIO_REG(a)     ((uint32_t *)((uint32_t)a - GPIO_BASE + (uint32_t)gpio_block))
 #define USEC_REG()      ((uint32_t *)(usec_block+4))
 #else
-#define GPIO_REG(a)     ((uint32_t *)a)
 #define USEC_REG()      ((uint32_t *)(USEC_BASE+4))
 #endif
+// System timer control/status, and compare 1, relative to counter
+#define TIMER_CS_REG()  ((volatile uint32_t *)USEC_REG() - 1)
+#define TIMER_C1_REG()  ((volatile uint32_t *)USEC_REG() + 3)
+#define TIMER_CS_M1     (1 << 1)
 
 #define GPIO_IN         0
 #define GPIO_OUT        1
@@ -79,26 +136,44 @@
 
 volatile void *gpio_block, *usec_block;
 
+// Periodic timer interrupt interval, and function to call
+int timer_usec;
+void (*timer_callback)(void);
+
+// Shadow copy of GPFSEL registers
+uint32_t gpio_fsel[GPIO_FSEL_REGS];
+
+// Flash read state: data pointer, bytes to be sent & received
+uint8_t *flash_rxp;
+int flash_txcount, flash_rxcount;
+
+#if FLASH_USE_DMA
+// Flash DMA: control blocks (Tx, Rx, Rx end), Tx data & SPI end value,
+// and length of current transfer
+DMA_CB flash_dma_cbs[3] DMA_ALIGN;
+uint32_t flash_dma_words[2] DMA_ALIGN;
+int flash_dma_len;
+#endif
+
+// CPU cycles per microsecond, zero if cycle counter not available
+int cycles_per_usec;
+
 #if INCLUDE_MAIN
 int main(int argc, char **argv)
 {
     int ticks=0, ledon=0;
-    uint8_t rxdata[100];
 
     gpio_set(LED_PIN, GPIO_OUT, GPIO_NOPULL);
     gpio_out(LED_PIN, 0);
-    spi0_init(10000);
+    cycle_init();
+    flash_init(FLASH_KHZ);
     ustimeout(&ticks, 0);
     while (1)
     {
         if (ustimeout(&ticks, 500000))
         {
             gpio_out(LED_PIN, ledon = !ledon);
-            flash_open_read(4);
-            flash_read(rxdata, 10);
-            flash_close();
-            disp_mem(rxdata, 10);
-            printf("\n");
+            flash_speed_test(FLASH_TEST_LEN);
             fflush(stdout);
         }
     }
@@ -109,28 +184,144 @@ int main(int argc, char **argv)
 // Start a flash read cycle (EN25Q80 device)
 void flash_open_read(int addr)
 {
-    uint8_t rxdata[4], txdata[4]={3, (uint8_t)(addr>>16), (uint8_t)(addr>>8), (uint8_t)(addr)};
+    uint8_t rxdata[5], txdata[5]={FLASH_FAST_READ ? FLASH_CMD_FASTREAD : FLASH_CMD_READ,
+        (uint8_t)(addr>>16), (uint8_t)(addr>>8), (uint8_t)(addr), 0};
     
     spi0_cs(1);
-    spi0_xfer(txdata, rxdata, 4);
+    spi0_xfer(txdata, rxdata, FLASH_FAST_READ ? 5 : 4);
 }
 // Read next block
 void flash_read(uint8_t *dp, int len)
 {
-    while (len--)
+    flash_read_start(dp, len);
+    while (flash_read_poll()) ;
+}
+// Start reading next block, without waiting for completion
+void flash_read_start(uint8_t *dp, int len)
+{
+    flash_rxp = dp;
+    flash_txcount = flash_rxcount = len;
+    flash_read_poll();
+}
+// Transfer as much data as the FIFOs allow, without waiting
+// Return number of bytes still to be read
+// If DMA is enabled, it is used for the bulk of an aligned transfer,
+// and the FIFOs for any remainder
+// No more than a FIFO-full is in flight, so the Tx FIFO can be filled
+// without checking, and the Rx FIFO can't overflow
+int flash_read_poll(void)
+{
+    uint32_t cs;
+    int n, nrx, ntx;
+
+#if FLASH_USE_DMA
+    if (flash_dma_len > 0)
     {
-        *SPI0_FIFO = 0;
-        while((*SPI0_CS & (1<<17)) == 0) ;
-        *dp++ = *SPI0_FIFO;
+        if (flash_dma_busy())
+            return(flash_rxcount);
+        flash_dma_end();
     }
+    if (flash_rxcount>=FLASH_DMA_MIN && flash_txcount==flash_rxcount &&
+        ((uintptr_t)flash_rxp & (DCACHE_LINE-1)) == 0)
+    {
+        flash_dma_start();
+        return(flash_rxcount);
+    }
+#endif
+    while (flash_rxcount > 0)
+    {
+        cs = *SPI0_CS;
+        // Drain Rx FIFO: a burst if 3/4 full, otherwise 1 byte
+        nrx = cs & SPI0_CS_RXR ? SPI0_RXR_LEN : cs & SPI0_CS_RXD ? 1 : 0;
+        nrx = nrx < flash_rxcount ? nrx : flash_rxcount;
+        flash_rxcount -= nrx;
+        for (n=0; n<nrx; n++)
+            *flash_rxp++ = (uint8_t)*SPI0_FIFO;
+        // Refill Tx FIFO
+        ntx = SPI0_FIFO_LEN - (flash_rxcount - flash_txcount);
+        ntx = ntx < flash_txcount ? ntx : flash_txcount;
+        flash_txcount -= ntx;
+        for (n=0; n<ntx; n++)
+            *SPI0_FIFO = 0;
+        if (nrx==0 && ntx==0)
+            break;
+    }
+    return(flash_rxcount);
+}
+
+#if FLASH_USE_DMA
+// Start DMA of whole words from flash to the current data pointer
+// Tx channel sends zero words, Rx channel stores the data, then
+// writes to the SPI control register to disable DMA mode
+void flash_dma_start(void)
+{
+    DMA_CB *cbs=UNCACHED(flash_dma_cbs);
+    uint32_t *words=UNCACHED(flash_dma_words), cs=*SPI0_CS & ~SPI0_CS_DMAEN;
+    int len=flash_rxcount & ~3;
+
+    flash_dma_len = len = len < FLASH_DMA_MAX ? len : FLASH_DMA_MAX;
+    dcache_clean_inval(flash_rxp, len);
+    words[0] = 0;
+    words[1] = cs;
+    cbs[0] = (DMA_CB){DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_SPI_TX),
+        BUS_RAM(&flash_dma_words[0]), BUS_PERIPH(SPI0_FIFO), len, 0, 0};
+    cbs[1] = (DMA_CB){DMA_TI_WAIT_RESP | DMA_TI_DEST_INC | DMA_TI_SRC_DREQ |
+        DMA_TI_PERMAP(DMA_PERMAP_SPI_RX), BUS_PERIPH(SPI0_FIFO), BUS_RAM(flash_rxp),
+        len, 0, BUS_RAM(&flash_dma_cbs[2])};
+    cbs[2] = (DMA_CB){DMA_TI_WAIT_RESP, BUS_RAM(&flash_dma_words[1]),
+        BUS_PERIPH(SPI0_CS), 4, 0, 0};
+    *DMA_ENABLE |= (1 << FLASH_DMA_TX) | (1 << FLASH_DMA_RX);
+    *DMA_CS(FLASH_DMA_TX) = *DMA_CS(FLASH_DMA_RX) = DMA_CS_RESET;
+    *SPI0_DLEN = len;
+    *SPI0_CS = cs | SPI0_CS_DMAEN;
+    *DMA_CONBLK(FLASH_DMA_RX) = BUS_RAM(&flash_dma_cbs[1]);
+    *DMA_CONBLK(FLASH_DMA_TX) = BUS_RAM(&flash_dma_cbs[0]);
+    *DMA_CS(FLASH_DMA_RX) = DMA_CS_END | DMA_CS_ACTIVE;
+    *DMA_CS(FLASH_DMA_TX) = DMA_CS_END | DMA_CS_ACTIVE;
 }
+// Return non-zero if flash DMA is in progress
+int flash_dma_busy(void)
+{
+    return(*DMA_CS(FLASH_DMA_RX) & DMA_CS_ACTIVE);
+}
+// Complete a flash DMA transfer
+void flash_dma_end(void)
+{
+    if ((*DMA_CS(FLASH_DMA_RX) | *DMA_CS(FLASH_DMA_TX)) & DMA_CS_ERROR)
+        printf("Flash DMA error\n");
+    dcache_inval(flash_rxp, flash_dma_len);
+    flash_rxp += flash_dma_len;
+    flash_rxcount -= flash_dma_len;
+    flash_txcount -= flash_dma_len;
+    flash_dma_len = 0;
+}
+#endif
+
 // End a flash ycle
 void flash_close(void)
 {
     spi0_cs(0);
 }
 
+// Time a flash read from address 0 (multiple of 8K bytes),
+// display speed, return microseconds
+int flash_speed_test(int len)
+{
+    static uint8_t rxbuff[0x2000] DMA_ALIGN;
+    int n, usec=ustime();
+
+    flash_open_read(0);
+    for (n=0; n<len; n+=sizeof(rxbuff))
+        flash_read(rxbuff, sizeof(rxbuff));
+    flash_close();
+    usec = ustime() - usec;
+    printf("Flash read %d bytes in %d usec, %d.%02d MB/s\n", len, usec,
+           len/usec, (len*100/usec) % 100);
+    return(usec);
+}
+
 // Initialise flash interface (SPI0)
+// Clock divisor is rounded up to an even number
 void flash_init(int khz)
 {
     gpio_set(SPI0_CE0_PIN, GPIO_ALT0, GPIO_NOPULL);
@@ -138,7 +329,7 @@ void flash_init(int khz)
     gpio_set(SPI0_MOSI_PIN, GPIO_ALT0, GPIO_NOPULL);
     gpio_set(SPI0_SCLK_PIN, GPIO_ALT0, GPIO_NOPULL);
     *SPI0_CS = 0x30;
-    *SPI0_CLK = CLOCK_KHZ / khz;
+    *SPI0_CLK = ((CLOCK_KHZ + khz - 1) / khz + 1) & ~1;
 }
 
 // Set / clear SPI chip select
@@ -161,7 +352,9 @@ void spi0_xfer(uint8_t *txd, uint8_t *rxd, int len)
 // Initialise GPIO and usec I/O blocks
 void mmap_init(void)
 {
-#if USE_MMAP
+#if USE_SIM
+    gpio_block = calloc(1, GPIO_SIZE);
+#elif USE_MMAP
     gpio_block = mmap_regs(GPIO_BASE, GPIO_SIZE);
     usec_block = mmap_regs(USEC_BASE, USEC_SIZE);
 #endif    
@@ -184,8 +377,8 @@ void dump_mem(void *addr, int len)
     for (i = 0; i<len; i++, addr+=4)
     {
         if (i%8 == 0)
-            printf("\n%04lX:", (uint32_t)addr);
-        printf(" %08lX", *GPIO_REG(addr));
+            printf("\n%04" PRIX32 ":", (uint32_t)(uintptr_t)addr);
+        printf(" %08" PRIX32, *GPIO_REG(addr));
     }
 }
 
@@ -201,7 +394,7 @@ void *mmap_regs(uint32_t addr, int len)
         printf("allocation error \n");
         exit(1);
     }
-    mem += PAGE_SIZE - ((uint32_t)mem % PAGE_SIZE);
+    mem += PAGE_SIZE - ((uintptr_t)mem % PAGE_SIZE);
     if ((fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0)
     {
         printf("can't open /dev/mem \n");
@@ -226,12 +419,45 @@ void gpio_set(int pin, int mode, int pull)
     gpio_pull(pin, pull);
 }
 
-// Set input or output
+// Set input or output, and update shadow register
 void gpio_mode(int pin, int mode)
 {
     uint32_t *reg = GPIO_REG(GPIO_MODE0) + pin / 10, shift = (pin % 10) * 3;
 
-    *reg = (*reg & ~(7 << shift)) | (mode << shift);
+    *reg = gpio_fsel[pin / 10] = (*reg & ~(7 << shift)) | (mode << shift);
+}
+
+// Switch modes of a group of pins, with a single register write
+void gpio_profile_set(GPIO_PROFILE *gp)
+{
+    uint32_t *reg = GPIO_REG(GPIO_MODE0) + gp->reg;
+
+    *reg = gpio_fsel[gp->reg] = (gpio_fsel[gp->reg] & ~gp->mask) | gp->bits;
+}
+
+// Enable or disable falling-edge detection on an I/P pin, clear any pending event
+void gpio_fall_detect(int pin, int on)
+{
+    uint32_t *reg = GPIO_REG(GPIO_FEN0) + pin/32, mask = 1 << (pin % 32);
+
+    *reg = on ? *reg | mask : *reg & ~mask;
+    gpio_event(pin);
+}
+
+// Return non-zero if an edge event is pending on a pin, and clear it
+// Event status is write-1-to-clear; the simulated register file is plain RAM
+int gpio_event(int pin)
+{
+    volatile uint32_t *reg = GPIO_REG(GPIO_EDS0) + pin/32;
+    uint32_t mask = 1 << (pin % 32);
+    int ev = (*reg & mask) != 0;
+
+#if USE_SIM
+    *reg &= ~mask;
+#else
+    *reg = mask;
+#endif
+    return(ev);
 }
 
 // Set I/P pullup or pulldown
@@ -280,10 +506,109 @@ uint8_t gpio_read(int pin, int npins)
     return(((*reg) >> (pin % 32)) & ((1 << npins) - 1));
 }
 
+// Set pad drive strength (0 - 7 for 2 - 16 mA) for the group containing pin
+// (pads aren't accessible if only the GPIO registers are mapped)
+void gpio_drive(int pin, int drive)
+{
+#if !USE_MMAP
+    uint32_t *reg = (uint32_t *)PADS_BASE + (pin < 28 ? 0 : pin < 46 ? 1 : 2);
+
+    *reg = PADS_PASSWD | PADS_SLEW | PADS_HYST | (drive & 7);
+#endif
+}
+
+// Start the ARM1176 cycle counter, and calibrate it against the usec timer
+void cycle_init(void)
+{
+#if !USE_MMAP
+    uint32_t c;
+    int ticks;
+
+    asm volatile ("mcr p15, 0, %0, c15, c12, 0" :: "r" (5));
+    usdelay(1);
+    ustimeout(&ticks, 0);
+    c = cycle_count();
+    while (!ustimeout(&ticks, 1000)) ;
+    cycles_per_usec = (cycle_count() - c + 500) / 1000;
+#endif
+}
+
+// Clean & invalidate data cache lines of a buffer, before DMA
+void dcache_clean_inval(void *p, int len)
+{
+#if !USE_MMAP
+    uintptr_t a=(uintptr_t)p & ~(DCACHE_LINE-1), end=(uintptr_t)p + len;
+
+    for (; a<end; a+=DCACHE_LINE)
+        asm volatile ("mcr p15, 0, %0, c7, c14, 1" :: "r" (a));
+    asm volatile ("mcr p15, 0, %0, c7, c10, 4" :: "r" (0));
+#endif
+}
+
+// Invalidate data cache lines of a buffer, after DMA
+void dcache_inval(void *p, int len)
+{
+#if !USE_MMAP
+    uintptr_t a=(uintptr_t)p & ~(DCACHE_LINE-1), end=(uintptr_t)p + len;
+
+    for (; a<end; a+=DCACHE_LINE)
+        asm volatile ("mcr p15, 0, %0, c7, c6, 1" :: "r" (a));
+#endif
+}
+
+// Return CPU cycle count
+uint32_t cycle_count(void)
+{
+    uint32_t c=0;
+
+#if !USE_MMAP
+    asm volatile ("mrc p15, 0, %0, c15, c12, 1" : "=r" (c));
+#endif
+    return(c);
+}
+
+// Convert nanoseconds to CPU cycles
+// If no cycle counter, return nanoseconds, for cycdelay to round up
+int ns_cycles(int nsec)
+{
+    return(cycles_per_usec ? (nsec * cycles_per_usec + 999) / 1000 : nsec);
+}
+
+// Delay given number of CPU cycles
+// If no cycle counter, the value is nanoseconds, rounded up to microseconds
+void cycdelay(int cycles)
+{
+    uint32_t c;
+
+    if (cycles_per_usec)
+    {
+        c = cycle_count();
+        while ((int)(cycle_count() - c) < cycles) ;
+    }
+    else if (cycles > 0)
+        usdelay((cycles + 999) / 1000);
+}
+
+// Delay given number of nanoseconds
+void nsdelay(int nsec)
+{
+    if (cycles_per_usec)
+        cycdelay(ns_cycles(nsec));
+    else
+        usdelay((nsec + 999) / 1000);
+}
+
 // Return timer tick value in microseconds
 int ustime(void)
 {
+#if USE_SIM
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((int)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000));
+#else
     return(*USEC_REG());
+#endif
 }
 
 // Delay given number of microseconds
@@ -298,7 +623,7 @@ void usdelay(int usec)
 // Return non-zero if timeout
 int ustimeout(int *tickp, int usec)
 {
-    int t = *USEC_REG();
+    int t = ustime();
 
     if (usec == 0 || t - *tickp >= usec)
     {
@@ -308,4 +633,38 @@ int ustimeout(int *tickp, int usec)
     return (0);
 }
 
+// Start periodic interrupt from system timer compare 1
+// Return 0 if not available (no interrupts on Linux)
+int timer_irq_start(int usec, void (*handler)(void))
+{
+#if USE_MMAP
+    return(0);
+#else
+    timer_usec = usec;
+    timer_callback = handler;
+    *TIMER_C1_REG() = *USEC_REG() + usec;
+    *TIMER_CS_REG() = TIMER_CS_M1;
+    CPU_irq_attach(IRQ_TIMER1, timer_irq_handler);
+    CPU_irq_enable();
+    return(1);
+#endif
+}
+
+// Stop periodic timer interrupt
+void timer_irq_stop(void)
+{
+    CPU_irq_detach(IRQ_TIMER1);
+    timer_callback = 0;
+}
+
+// Handle timer interrupt: set next match time, clear match, call handler
+// (next time is relative to now, so a late interrupt doesn't cause a backlog)
+void timer_irq_handler(void)
+{
+    *TIMER_C1_REG() = *USEC_REG() + timer_usec;
+    *TIMER_CS_REG() = TIMER_CS_M1;
+    if (timer_callback)
+        timer_callback();
+}
+
 // EOF
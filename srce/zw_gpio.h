@@ -15,7 +15,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+// Set USE_SIM non-zero (e.g. -DUSE_SIM=1) to build for a Linux host,
+// with a simulated GPIO register file and the host clock
+#ifndef USE_SIM
+#define USE_SIM     0
+#endif
+
+#if USE_SIM
+#define USE_MMAP    1
+#else
 #define USE_MMAP    0
+#endif
 
 #define REG_BASE    0x20000000      // Pi Zero
 //#define REG_BASE    0x3F000000    // Pi 3
@@ -24,6 +34,60 @@
 
 #define CLOCK_KHZ       250000
 
+// SPI flash clock, and read command: fast read has a dummy byte
+// after the address, but is specified up to 104 MHz (EN25Q80)
+#define FLASH_KHZ       31250
+#define FLASH_FAST_READ 1
+
+// Length of flash read speed test (firmware-sized)
+#define FLASH_TEST_LEN  0x60000
+
+// Set non-zero to use DMA for flash reads (not available via mmap)
+// Buffer must be aligned to a cache line, DMA_ALIGN is used for this
+#if USE_MMAP
+#define FLASH_USE_DMA   0
+#else
+#define FLASH_USE_DMA   1
+#endif
+#define DMA_ALIGN       __attribute__ ((aligned (32)))
+
+#define GPIO_BASE       (REG_BASE + 0x200000)
+#define GPIO_SIZE       0x20000
+#define GPIO_MODE0      (uint32_t *)GPIO_BASE
+#define GPIO_SET0       (uint32_t *)(GPIO_BASE + 0x1c)
+#define GPIO_CLR0       (uint32_t *)(GPIO_BASE + 0x28)
+#define GPIO_LEV0       (uint32_t *)(GPIO_BASE + 0x34)
+#define GPIO_EDS0       (uint32_t *)(GPIO_BASE + 0x40)
+#define GPIO_FEN0       (uint32_t *)(GPIO_BASE + 0x58)
+
+// GPU interrupt numbers for GPIO banks 0 & 1 (any enabled edge or level)
+#define IRQ_GPIO_BANK0  49
+#define IRQ_GPIO_BANK1  50
+
+// GPU interrupt number for system timer compare 1 (0 & 2 are used by the GPU)
+#define IRQ_TIMER1      1
+
+#if USE_MMAP
+#define GPIO_REG(a)     ((uint32_t *)((uintptr_t)(a) - GPIO_BASE + (uintptr_t)gpio_block))
+#else
+#define GPIO_REG(a)     ((uint32_t *)(a))
+#endif
+
+// Inline accessors for pin numbers known at compile time, so each is
+// a single load or store with a constant address & mask. Multi-pin
+// accesses must be within one 32-bit bank.
+#define GPIO_BANK(reg, pin)     ((volatile uint32_t *)GPIO_REG(reg) + (pin) / 32)
+#define GPIO_MASK(pin)          (1u << ((pin) % 32))
+#define GPIO_NMASK(pin, n)      (((1u << (n)) - 1) << ((pin) % 32))
+#define GPIO_PIN_SET(pin)       (*GPIO_BANK(GPIO_SET0, pin) = GPIO_MASK(pin))
+#define GPIO_PIN_CLR(pin)       (*GPIO_BANK(GPIO_CLR0, pin) = GPIO_MASK(pin))
+#define GPIO_PIN_OUT(pin, val)  (*GPIO_BANK((val) ? GPIO_SET0 : GPIO_CLR0, pin) = GPIO_MASK(pin))
+#define GPIO_PIN_IN(pin)        ((*GPIO_BANK(GPIO_LEV0, pin) >> ((pin) % 32)) & 1)
+#define GPIO_PINS_IN(pin, n)    ((*GPIO_BANK(GPIO_LEV0, pin) & GPIO_NMASK(pin, n)) >> ((pin) % 32))
+#define GPIO_PINS_OUT(pin, n, val) {\
+    *GPIO_BANK(GPIO_SET0, pin) = ((uint32_t)(val) << ((pin) % 32)) & GPIO_NMASK(pin, n); \
+    *GPIO_BANK(GPIO_CLR0, pin) = (~(uint32_t)(val) << ((pin) % 32)) & GPIO_NMASK(pin, n);}
+
 #define GPIO_IN         0
 #define GPIO_OUT        1
 #define GPIO_ALT0       4
@@ -37,9 +101,35 @@
 #define GPIO_PULLDN     1
 #define GPIO_PULLUP     2
 
+// Pin-mux profile: modes for a group of consecutive pins in one GPFSEL
+// register, so they can be switched with a single store. The register
+// value is shadowed in RAM, gpio_mode must have been called for a pin
+// in the same register before the profile is used.
+typedef struct {
+    int reg;
+    uint32_t mask, bits;
+} GPIO_PROFILE;
+
+#define GPIO_FSEL_REGS  6
+#define GPIO_PROFILE_MASK(pin, n)   (((1u << ((n)*3)) - 1) << ((pin) % 10 * 3))
+#define GPIO_PROFILE(pin, n, mode)  {(pin) / 10, GPIO_PROFILE_MASK(pin, n), \
+    GPIO_PROFILE_MASK(pin, n) & ((mode) * 0x09249249u) << ((pin) % 10 * 3)}
+
+extern volatile void *gpio_block;
+extern uint32_t gpio_fsel[GPIO_FSEL_REGS];
+extern int cycles_per_usec;
+
 void flash_open_read(int addr);
 void flash_read(uint8_t *dp, int len);
+void flash_read_start(uint8_t *dp, int len);
+int flash_read_poll(void);
+void flash_dma_start(void);
+int flash_dma_busy(void);
+void flash_dma_end(void);
+void dcache_clean_inval(void *p, int len);
+void dcache_inval(void *p, int len);
 void flash_close(void);
+int flash_speed_test(int len);
 
 void flash_init(int khz);
 void spi0_cs(int set);
@@ -51,13 +141,29 @@ void dump_mem(void *addr, int len);
 void gpio_mmap(void);
 void gpio_set(int pin, int mode, int pull);
 void gpio_mode(int pin, int mode);
+void gpio_profile_set(GPIO_PROFILE *gp);
 void gpio_pull(int pin, int pull);
 void gpio_out(int pin, int val);
 uint8_t gpio_in(int pin);
 uint8_t gpio_read(int pin, int npins);
 void gpio_write(int pin, int npins, uint32_t val);
+void gpio_drive(int pin, int drive);
+void gpio_fall_detect(int pin, int on);
+int gpio_event(int pin);
+void CPU_irq_attach(int irq, void (*handler)(void));
+void CPU_irq_detach(int irq);
+void CPU_irq_enable(void);
+void CPU_irq_disable(void);
+void cycle_init(void);
+uint32_t cycle_count(void);
+int ns_cycles(int nsec);
+void cycdelay(int cycles);
+void nsdelay(int nsec);
 int ustime(void);
 void usdelay(int usec);
 int ustimeout(int *tickp, int usec);
+int timer_irq_start(int usec, void (*handler)(void));
+void timer_irq_stop(void);
+void timer_irq_handler(void);
 
 // EOF
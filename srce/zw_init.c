@@ -0,0 +1,657 @@
+// ZeroWi bare-metal WiFi driver, see https://iosoft.blog/zerowi
+// Chip initialisation program, firmware & config download
+//
+// Copyright (c) 2020 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "zw_gpio.h"
+#include "zw_crc.h"
+#include "zw_sdio.h"
+#include "zw_regs.h"
+#include "zw_init.h"
+
+#if INCLUDE_FIRMWARE
+#if FIRMWARE_LZ4
+extern const unsigned char firmware_lz4[];
+#else
+extern const unsigned char firmware_bin[FIRMWARE_LEN];
+#endif
+uint32_t firmware_pos;
+#endif
+
+#if FIRMWARE_LZ4
+// Destination & length of current read, and next block header
+uint8_t *firm_dp;
+int firm_len, firm_hdr;
+#if !INCLUDE_FIRMWARE
+// Compressed block from flash, plus header of the following block
+uint8_t firm_lz4_buff[FIRM_LZ4_BLOCK + 2] DMA_ALIGN;
+#endif
+#endif
+
+// Configuration for brcmfmac43430-sdio
+uint8_t config_data[] = 
+"manfid=0x2d0\0""prodid=0x0726\0""vendid=0x14e4\0""devid=0x43e2\0"
+"boardtype=0x0726\0""boardrev=0x1202\0""boardnum=22\0""macaddr=00:90:4c:c5:12:38\0"
+"sromrev=11\0""boardflags=0x00404201\0""boardflags3=0x08000000\0""xtalfreq=37400\0"
+"nocrc=1\0""ag0=255\0""aa2g=1\0""ccode=ALL\0""pa0itssit=0x20\0""extpagain2g=0\0"
+"pa2ga0=-168,7161,-820\0""AvVmid_c0=0x0,0xc8\0""cckpwroffset0=5\0""maxp2ga0=84\0"
+"txpwrbckof=6\0""cckbw202gpo=0\0""legofdmbw202gpo=0x66111111\0"
+"mcsbw202gpo=0x77711111\0""propbw202gpo=0xdd\0""ofdmdigfilttype=18\0"
+"ofdmdigfilttypebe=18\0""papdmode=1\0""papdvalidtest=1\0""pacalidx2g=32\0"
+"papdepsoffset=-36\0""papdendidx=61\0""il0macaddr=00:90:4c:c5:12:38\0"
+"wl0id=0x431b\0""deadman_to=0xffffffff\0""muxenab=0x1\0""spurconfig=0x3 \0"
+"btc_mode=1\0""btc_params8=0x4e20\0""btc_params1=0x7530\0""\0\0\0\0\xaa\x00\x55\xff";
+int config_len = sizeof(config_data) - 1;
+
+// SDIO Tx buffer (must be multiple of 256, and less than 32K)
+// split into 2 halves for double-buffered firmware download
+uint8_t txbuffer[0x4000] DMA_ALIGN;
+
+// Card address, index of failed init step (-1 if none), warm start flag
+int sdio_rca, init_fail_step=-1, init_warm;
+
+// Data from init step reads
+uint8_t init_data[INIT_MAX_READ];
+
+// Chip initialisation programs
+// Timestamps are from a Linux trace, the original fixed delays
+// are replaced by polling of the clock & ready states
+// Start: reset SDIO interface, and get chip ID
+INIT_STEP sdio_start_steps[] = {
+    // Reset I/O; instead of waiting 20 ms after the reset, CMD5 is
+    // polled until the card is ready, and CMD3 until it responds
+    STEP_RD(SD_FUNC_BUS, BUS_IOABORT_REG, 1),
+    STEP_WR(SD_FUNC_BUS, BUS_IOABORT_REG, BUS_IO_RESET, 1),
+    STEP_CMD(0, 0),
+    STEP_CMD(8, 0x1aa),
+    // Enable I/O mode
+    STEP_CMD(5, 0),
+    STEP_CMD_POLL(5, 0x200000, SD_OCR_READY, 100000),
+    // Assert SD device
+    STEP_SELECT(20000),
+    // [0.243831] Set bus interface
+    STEP_WR(SD_FUNC_BUS, BUS_SPEED_CTRL_REG, 0x03, 1),
+    STEP_WR(SD_FUNC_BUS, BUS_BI_CTRL_REG, 0x42, 1),
+    // [17.999101] Set block sizes
+    STEP_WR(SD_FUNC_BUS, BUS_BAK_BLKSIZE_REG, SD_BAK_BLK_BYTES, 2),
+    STEP_WR(SD_FUNC_BUS, BUS_RAD_BLKSIZE_REG, SD_RAD_BLK_BYTES, 2),
+    // [17.999944] Enable I/O 
+    STEP_WR(SD_FUNC_BUS, BUS_IOEN_REG, 1<<SD_FUNC_BAK, 1),
+    STEP_POLL(SD_FUNC_BUS, BUS_IORDY_REG, 1, 0xff, 2, 10000),
+    // [18.001905] Read chip ID 
+    STEP_RD32(BAK_BASE_ADDR),
+    // [18.002173] Set chip clock
+    STEP_WR(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0x28, 1),
+    STEP_RD(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 1),
+    STEP_WR(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0x21, 1),
+    // [18.004850] Disable pullups 
+    STEP_WR(SD_FUNC_BAK, BAK_PULLUP_REG, 0, 1),
+    // Find fastest reliable clock
+    STEP_CALL(init_clk_tune),
+    // Get chip ID again, and config base addr [18.005201]
+    STEP_RD32(BAK_BASE_ADDR),
+    STEP_RD32(BAK_BASE_ADDR+0xfc),
+    STEP_END()
+};
+
+// Warm start check: ARM CPU running, and firmware fingerprint in RAM
+INIT_STEP sdio_warm_steps[] = {
+    STEP_CHECK32(ARM_IOCTRL_REG, 0xff, 1),
+    STEP_CHECK32(ARM_RESETCTRL_REG, 0xff, 0),
+    STEP_CALL(init_fprint_check),
+    STEP_END()
+};
+
+// Cold start: reset cores, load firmware & config, start ARM CPU
+INIT_STEP sdio_cold_steps[] = {
+    // Reset cores [18.030305]
+    STEP_SYNC(),
+    STEP_WR32(ARM_IOCTRL_REG, 0x03),
+    STEP_WR32(MAC_IOCTRL_REG, 0x07),
+    STEP_WR32(MAC_RESETCTRL_REG, 0x00),
+    STEP_WR32(MAC_IOCTRL_REG, 0x05),
+    // [18.032572]
+    STEP_SYNC(),
+    STEP_WR32(SRAM_IOCTRL_REG, 0x03),
+    STEP_WR32(SRAM_RESETCTRL_REG, 0x00),
+    STEP_WR32(SRAM_IOCTRL_REG, 0x01),
+    STEP_CHECK32(SRAM_IOCTRL_REG, 0xff, 1),
+    // [18.034039]
+    STEP_WR32(SRAM_BANKX_IDX_REG, 0x03),
+    STEP_WR32(SRAM_BANKX_PDA_REG, 0x00),
+    // [18.034733]
+    STEP_CHECK32(SRAM_IOCTRL_REG, 0xff, 1),
+    STEP_CHECK32(SRAM_RESETCTRL_REG, 0xff, 0),
+    // [18.035416]
+    STEP_RD32(SRAM_BASE_ADDR),
+    STEP_WR32(SRAM_BANKX_IDX_REG, 0),
+    STEP_RD32(SRAM_UNKNOWN_REG),
+    STEP_WR32(SRAM_BANKX_IDX_REG, 1),
+    STEP_RD32(SRAM_UNKNOWN_REG),
+    STEP_WR32(SRAM_BANKX_IDX_REG, 2),
+    STEP_RD32(SRAM_UNKNOWN_REG),
+    STEP_WR32(SRAM_BANKX_IDX_REG, 3),
+    // [18.037502]
+    STEP_CHECK(SD_FUNC_BUS, BUS_BRCM_CARDCTRL, 1, 0xff, 1),
+    STEP_WR(SD_FUNC_BUS, BUS_BRCM_CARDCTRL, 3, 1),
+    STEP_OR(BAK_FUNC_WIN, BAK_BASE_ADDR+0x600, 0x4000, 4),
+    // [18.052762] Request ALP clock
+    STEP_WR(SD_FUNC_BUS, BUS_IOEN_REG, 1<<SD_FUNC_BAK, 1),
+    STEP_WR(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0, 1),
+    STEP_WR(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, CSR_ALP_REQ, 1),
+    STEP_POLL(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 1, 0xff, CSR_ALP_AVAIL|CSR_ALP_REQ, 50000),
+    // [18.100946] Load firmware
+    STEP_CALL(write_firmware),
+    STEP_RD32(0x5ee80),
+#if FIRM_VERIFY
+    STEP_CALL(verify_firmware),
+#endif
+    // [19.143195] Load config data
+    STEP_CALL(write_nvram),
+    STEP_RD(BAK_FUNC_WIN, 0x7ffd4, 44),
+    // [19.146150] Clear interrupts, then SRAM & ARM core in one window
+    STEP_WR32(SB_INT_STATUS_REG, 0xffffffff),
+    STEP_RD32(SRAM_IOCTRL_REG),
+    STEP_RD32(SRAM_RESETCTRL_REG),
+    // [19.147404] Start ARM CPU
+    STEP_SYNC(),
+    STEP_WR32(ARM_IOCTRL_REG, 0x03),
+    STEP_WR32(ARM_RESETCTRL_REG, 0x00),
+    STEP_WR32(ARM_IOCTRL_REG, 0x01),
+    STEP_RD32(ARM_IOCTRL_REG),
+    STEP_END()
+};
+
+// Radio: wait for HT clock, and enable function 2
+INIT_STEP sdio_radio_steps[] = {
+    // Request HT clock
+    STEP_SYNC(),
+    STEP_WR(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0, 1),
+    STEP_WR(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, CSR_HT_REQ, 1),
+    STEP_POLL(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 1, 0xff,
+              CSR_HT_AVAIL|CSR_ALP_AVAIL|CSR_HT_REQ, 100000),
+    // [19.190728] Enable radio function, wait until ready
+    STEP_WR(SD_FUNC_BAK, BAK_CHIP_CLOCK_CSR_REG, 0xd2, 1),
+    STEP_WR32(SB_TO_SB_MBOX_DATA_REG, 0x40000),
+    STEP_SYNC(),
+    STEP_WR(SD_FUNC_BUS, BUS_IOEN_REG, (1<<SD_FUNC_BAK) | (1<<SD_FUNC_RAD), 1),
+    STEP_POLL(SD_FUNC_BUS, BUS_IORDY_REG, 1, 0xff, 0x06, 200000),
+    STEP_WR32(SB_INT_HOST_MASK_REG, 0x200000f0),
+    STEP_RD32(SR_CONTROL1),
+    // [19.282972]
+    STEP_WR(SD_FUNC_BAK, BAK_WAKEUP_REG, 2, 1),
+    STEP_WR(SD_FUNC_BUS, BUS_BRCM_CARDCAP, 6, 1),
+    STEP_WR(SD_FUNC_BUS, BUS_INTEN_REG, 0x07, 1),
+    STEP_RD(SD_FUNC_BUS, BUS_INTPEND_REG, 1),
+    // [19.284023]
+    STEP_SYNC(),
+    STEP_RD32(SB_INT_STATUS_REG),
+    STEP_WR32(SB_INT_STATUS_REG, 0x200000c0),
+    STEP_RD32(SB_TO_HOST_MBOX_DATA_REG),
+    STEP_WR32(SB_TO_SB_MBOX_REG, 0x02),
+    STEP_RD32(SR_CONTROL1),
+    // [19.285708] Byte read at 0x70d4 in the window set by the 32-bit read
+    STEP_SYNC(),
+    STEP_RD32(0x68000 | 0x7ffc),
+    STEP_RD(SD_FUNC_BAK, 0x70d4, 64),
+    // [19.286520]
+    STEP_RD32(SB_INT_STATUS_REG),
+    STEP_WR32(SB_INT_STATUS_REG, 0x80),
+    STEP_RD(SD_FUNC_RAD, SB_32BIT_WIN, 64),
+    STEP_END()
+};
+
+// Initialise SDIO interface & chip, return card address, 0 if failed
+// If the firmware is already running, skip the download (warm start)
+int sdio_init(void)
+{
+    int ok;
+
+    sdio_rca = init_warm = 0;
+    ok = init_run(sdio_start_steps);
+#if WARM_START
+    if (ok && init_run(sdio_warm_steps))
+    {
+        // If firmware isn't responding, reset and do a cold start
+        if ((init_warm = init_run(sdio_radio_steps)) == 0)
+            ok = init_run(sdio_start_steps);
+    }
+#endif
+    if (ok && !init_warm)
+        ok = init_run(sdio_cold_steps) && init_run(sdio_radio_steps);
+    if (!ok)
+    {
+        printf("Init step %d failed\n", init_fail_step);
+        disp_log_break();
+    }
+    return(ok ? sdio_rca : 0);
+}
+
+// Run an init program, return 0 if a step fails
+// Successive reads & writes are sent as a backplane batch, grouped by
+// function & window, with sync steps where the order matters
+int init_run(INIT_STEP *steps)
+{
+    INIT_STEP *sp;
+
+    init_fail_step = -1;
+    bak_batch_start();
+    for (sp=steps; sp->op!=INIT_END; sp++)
+    {
+        if ((sp->op==INIT_WR || sp->op==INIT_RD) && sp->nbytes<=4 &&
+            bak_nops < BAK_MAX_OPS-1)
+        {
+            bak_queue(sp->func, sp->addr, sp->val, sp->nbytes, sp->op==INIT_WR);
+            continue;
+        }
+        if (sp->op == INIT_SYNC)
+        {
+            bak_queue_sync();
+            continue;
+        }
+        bak_batch_run();
+        bak_batch_start();
+        if (!init_step(sp))
+        {
+            init_fail_step = (int)(sp - steps);
+            return(0);
+        }
+    }
+    bak_batch_run();
+    bak_batch_start();
+    return(1);
+}
+
+// Execute a single init step, return 0 if failed
+int init_step(INIT_STEP *sp)
+{
+    SDIO_MSG rsp;
+    uint32_t val=0;
+    int ok=1, ticks;
+
+    ustimeout(&ticks, 0);
+    switch (sp->op)
+    {
+    case INIT_CMD:
+        sdio_cmd(sp->addr, sp->val, 0);
+        break;
+    case INIT_CMD_POLL:
+        while (!(ok = sdio_cmd(sp->addr, sp->val, &rsp) &&
+                 (SWAP32(rsp.msg.argx) & sp->mask) == sp->mask) &&
+               !ustimeout(&ticks, sp->usec)) ;
+        break;
+    case INIT_SELECT:
+        sdio_bak_window_reset();
+        while (!(ok = sdio_cmd(3, 0, &rsp) > 0) && !ustimeout(&ticks, sp->usec)) ;
+        sdio_rca = SWAP16(rsp.rsp3.rcax);
+        sdio_cmd7(sdio_rca, 0);
+        break;
+    case INIT_WR:
+        bak_queue(sp->func, sp->addr, sp->val, sp->nbytes, SD_WR);
+        bak_batch_run();
+        break;
+    case INIT_RD:
+        init_read(sp->func, sp->addr, &val, sp->nbytes);
+        break;
+    case INIT_OR:
+        if ((ok = init_read(sp->func, sp->addr, &val, sp->nbytes)) != 0)
+        {
+            bak_queue(sp->func, sp->addr, val | sp->val, sp->nbytes, SD_WR);
+            bak_batch_run();
+        }
+        break;
+    case INIT_POLL:
+        while (!(ok = init_read(sp->func, sp->addr, &val, sp->nbytes) &&
+                 (val & sp->mask) == sp->val) && !ustimeout(&ticks, sp->usec)) ;
+        break;
+    case INIT_CALL:
+        ok = sp->fn() != 0;
+        break;
+    case INIT_DELAY:
+        usdelay(sp->usec);
+        break;
+    }
+    bak_batch_start();
+    return(ok);
+}
+
+// Read 1 - 4 byte value, or longer block into init data buffer
+// Return 0 if failed
+int init_read(int func, uint32_t addr, uint32_t *valp, int nbytes)
+{
+    int n;
+
+    nbytes = MIN(nbytes, INIT_MAX_READ);
+    if (nbytes <= 4)
+    {
+        bak_batch_start();
+        n = bak_queue(func, addr, 0, nbytes, SD_RD);
+        bak_batch_run();
+        *valp = bak_result(n);
+        return(bak_ops[n].ok);
+    }
+    if (func == BAK_FUNC_WIN)
+    {
+        sdio_bak_window(addr);
+        addr = (addr & SB_ADDR_MASK) | (nbytes%4 ? 0 : SB_32BIT_WIN);
+        func = SD_FUNC_BAK;
+    }
+    return(sdio_cmd53_read(func, addr, init_data, nbytes) > 0);
+}
+
+// Find fastest reliable SDIO clock
+int init_clk_tune(void)
+{
+    return(sdio_clk_tune(SD_CLK_MIN_NSEC, SD_CLK_NSEC, 1));
+}
+
+// Check firmware fingerprint: a sample of the image must match chip RAM
+int init_fprint_check(void)
+{
+    uint32_t val;
+
+    firm_open_read(0);
+    firm_read(txbuffer, MIN(FIRM_BUFF_LEN, FIRMWARE_LEN));
+    firm_close();
+    return(init_read(BAK_FUNC_WIN, FIRM_FPRINT_ADDR, &val, FIRM_FPRINT_LEN) &&
+           !memcmp(init_data, &txbuffer[FIRM_FPRINT_ADDR], FIRM_FPRINT_LEN));
+}
+
+// Decode LZ4 block, given header value, return decoded length, -1 if error
+int lz4_block_decode(const uint8_t *src, int hdr, uint8_t *dst, int dmax)
+{
+    const uint8_t *send, *mp;
+    uint8_t *dp=dst, *dend=dst+dmax;
+    int token, n, len=hdr & ~FIRM_LZ4_RAW;
+
+    if (hdr & FIRM_LZ4_RAW)
+    {
+        if (len > dmax)
+            return(-1);
+        memcpy(dst, src, len);
+        return(len);
+    }
+    send = src + len;
+    while (src < send)
+    {
+        token = *src++;
+        // Literal length, then literals
+        if ((len = token >> 4) == 15)
+        {
+            do {
+                if (src >= send)
+                    return(-1);
+                len += n = *src++;
+            } while (n == 255);
+        }
+        if (len > send-src || len > dend-dp)
+            return(-1);
+        memcpy(dp, src, len);
+        dp += len;
+        src += len;
+        // Last sequence has no match
+        if (src >= send)
+            break;
+        if (send-src < 2)
+            return(-1);
+        mp = dp - (src[0] | src[1] << 8);
+        src += 2;
+        if ((len = token & 15) == 15)
+        {
+            do {
+                if (src >= send)
+                    return(-1);
+                len += n = *src++;
+            } while (n == 255);
+        }
+        len += 4;
+        if (mp < dst || mp == dp || len > dend-dp)
+            return(-1);
+        // Match may overlap output, so copy bytewise
+        while (len--)
+            *dp++ = *mp++;
+    }
+    return(dp - dst);
+}
+
+// Functions to access firmware image
+// Open for reading
+void firm_open_read(int addr)
+{
+#if INCLUDE_FIRMWARE
+    firmware_pos = addr;
+#else
+    flash_open_read(addr);
+#if FIRMWARE_LZ4
+    flash_read(firm_lz4_buff, 2);
+    firm_hdr = firm_lz4_buff[0] | firm_lz4_buff[1] << 8;
+#endif
+#endif
+}
+// Read n bytes
+void firm_read(uint8_t *dp, int len)
+{
+    firm_read_start(dp, len);
+    while (firm_read_poll()) ;
+}
+// Start reading n bytes, without waiting for completion
+// If compressed, n must be a multiple of the block size (except at the end)
+void firm_read_start(uint8_t *dp, int len)
+{
+#if FIRMWARE_LZ4
+    firm_dp = dp;
+    firm_len = len;
+#if !INCLUDE_FIRMWARE
+    flash_read_start(firm_lz4_buff, (firm_hdr & ~FIRM_LZ4_RAW) + 2);
+#endif
+    firm_read_poll();
+#elif INCLUDE_FIRMWARE
+    memcpy(dp, &firmware_bin[firmware_pos], len);
+    firmware_pos += len;
+#else
+    flash_read_start(dp, len);
+#endif
+}
+// Continue reading, return number of bytes still to be read
+int firm_read_poll(void)
+{
+#if FIRMWARE_LZ4
+    const uint8_t *src;
+    int n, hdr;
+
+    while (firm_len > 0)
+    {
+#if INCLUDE_FIRMWARE
+        src = &firmware_lz4[firmware_pos];
+        hdr = src[0] | src[1] << 8;
+        src += 2;
+        firmware_pos += (hdr & ~FIRM_LZ4_RAW) + 2;
+#else
+        if (flash_read_poll())
+            return(firm_len);
+        src = firm_lz4_buff;
+        hdr = firm_hdr;
+        n = hdr & ~FIRM_LZ4_RAW;
+        firm_hdr = firm_lz4_buff[n] | firm_lz4_buff[n+1] << 8;
+#endif
+        n = hdr ? lz4_block_decode(src, hdr, firm_dp, MIN(firm_len, FIRM_LZ4_BLOCK)) : -1;
+        if (n <= 0)
+        {
+            printf("Firmware decode error\n");
+            firm_len = 0;
+            break;
+        }
+        firm_dp += n;
+        firm_len -= n;
+#if !INCLUDE_FIRMWARE
+        if (firm_len > 0)
+            flash_read_start(firm_lz4_buff, (firm_hdr & ~FIRM_LZ4_RAW) + 2);
+#endif
+    }
+    return(0);
+#elif INCLUDE_FIRMWARE
+    return(0);
+#else
+    return(flash_read_poll());
+#endif
+}
+// Poll hook, to read firmware while SDIO blocks are sent
+void firm_poll_hook(void)
+{
+    firm_read_poll();
+}
+// Close
+void firm_close(void)
+{
+#if !INCLUDE_FIRMWARE
+    flash_close();
+#endif
+}
+
+// Upload blocks of firmware from flash to chip RAM
+// Double-buffered: the next block is read from flash while the
+// current block is sent over SDIO
+int write_firmware(void)
+{
+    int len, n, nbytes=0, nblocks, buff=0;
+    uint8_t *dp;
+    uint32_t addr;
+
+    firm_open_read(0);
+    firm_read_start(txbuffer, MIN(FIRM_BUFF_LEN, FIRMWARE_LEN));
+    while (nbytes < FIRMWARE_LEN)
+    {
+        while (firm_read_poll()) ;
+        dp = &txbuffer[buff * FIRM_BUFF_LEN];
+        len = MIN(FIRM_BUFF_LEN, FIRMWARE_LEN-nbytes);
+        if (nbytes+len < FIRMWARE_LEN)
+        {
+            buff ^= 1;
+            firm_read_start(&txbuffer[buff * FIRM_BUFF_LEN],
+                            MIN(FIRM_BUFF_LEN, FIRMWARE_LEN-nbytes-len));
+        }
+        addr = sdio_bak_addr(nbytes);
+        nblocks = len / SD_BAK_BLK_BYTES;
+        sdio_poll_hook = firm_poll_hook;
+        n = nblocks ? sdio_write_blocks(SD_FUNC_BAK, SB_32BIT_WIN+addr, dp, nblocks) : 0;
+        sdio_poll_hook = 0;
+        if (n != nblocks)
+            break;
+        n = nblocks * SD_BAK_BLK_BYTES;
+        if (len > n)
+            sdio_cmd53_write(SD_FUNC_BAK, SB_32BIT_WIN+addr+n, &dp[n], len-n);
+        nbytes += len;
+    }
+    while (firm_read_poll()) ;
+    firm_close();
+    return(nbytes);
+}
+
+// Verify firmware in chip RAM, using block reads and CRC32
+// If incorrect, find the first bad block by comparing with the image
+int verify_firmware(void)
+{
+    int len, nbytes=0;
+    uint32_t crc=0;
+
+    while (nbytes < FIRMWARE_LEN)
+    {
+        len = MIN(FIRM_BUFF_LEN, FIRMWARE_LEN-nbytes);
+        if (!read_chip_ram(nbytes, txbuffer, len))
+            break;
+        crc = crc32_data(crc, txbuffer, len);
+        nbytes += len;
+    }
+    if (nbytes==FIRMWARE_LEN && crc==FIRMWARE_CRC32)
+        return(1);
+    printf("Firmware verify failed, CRC %08X, first bad block %05X\n",
+           crc, firm_find_error());
+    return(0);
+}
+
+// Compare chip RAM with firmware image, return address of first
+// incorrect block, -1 if none
+int firm_find_error(void)
+{
+    uint8_t *ip=txbuffer, *rp=&txbuffer[FIRM_BUFF_LEN];
+    int n, len, nbytes, ret=-1;
+
+    firm_open_read(0);
+    for (nbytes=0; ret<0 && nbytes<FIRMWARE_LEN; nbytes+=len)
+    {
+        len = MIN(FIRM_BUFF_LEN, FIRMWARE_LEN-nbytes);
+        firm_read(ip, len);
+        if (!read_chip_ram(nbytes, rp, len))
+            ret = nbytes;
+        for (n=0; ret<0 && n<len; n+=SD_BAK_BLK_BYTES)
+        {
+            if (memcmp(&ip[n], &rp[n], MIN(SD_BAK_BLK_BYTES, len-n)))
+                ret = nbytes + n;
+        }
+    }
+    firm_close();
+    return(ret);
+}
+
+// Read chip RAM in blocks, must not cross a window boundary
+// Return 0 if failed
+int read_chip_ram(uint32_t addr, uint8_t *dp, int len)
+{
+    int n, retries=SD_CRC_RETRIES, nblocks=len / SD_BAK_BLK_BYTES;
+    uint32_t a=SB_32BIT_WIN + sdio_bak_addr(addr);
+
+    do {
+        n = nblocks ? sdio_read_blocks(SD_FUNC_BAK, a, dp, nblocks) : 0;
+    } while (n==SD_CRC_ERR && retries--);
+    if (n != nblocks)
+        return(0);
+    n = nblocks * SD_BAK_BLK_BYTES;
+    return(len==n || sdio_cmd53_read(SD_FUNC_BAK, a+n, &dp[n], len-n) > 0);
+}
+
+// Upload blocks of config data to chip NVRAM
+int write_nvram(void)
+{
+    int nbytes=0, len;
+
+    sdio_bak_window(0x078000);
+    while (nbytes < config_len)
+    {
+        len = MIN(config_len-nbytes, SD_BAK_BLK_BYTES);
+        sdio_cmd53_write(SD_FUNC_BAK, 0xfd54+nbytes, &config_data[nbytes], len);
+        nbytes += len;
+    }
+    return(nbytes);
+}
+
+// Set up SD interface
+void sd_setup(void)
+{
+    gpio_set(SD_CLK_PIN, GPIO_OUT, GPIO_NOPULL);
+    gpio_set(SD_CMD_PIN, GPIO_IN, GPIO_PULLUP);
+    gpio_set(SD_D0_PIN, GPIO_IN, GPIO_PULLUP);
+    gpio_set(SD_D1_PIN, GPIO_IN, GPIO_PULLUP);
+    gpio_set(SD_D2_PIN, GPIO_IN, GPIO_PULLUP);
+    gpio_set(SD_D3_PIN, GPIO_IN, GPIO_PULLUP);
+}
+
+#if INCLUDE_FIRMWARE
+#include FIRMWARE_FNAME
+#endif
+// EOF
@@ -0,0 +1,131 @@
+// ZeroWi bare-metal WiFi driver, see https://iosoft.blog/zerowi
+// Chip initialisation definitions
+//
+// Copyright (c) 2020 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Set non-zero to include WiFi firmware in image
+#define INCLUDE_FIRMWARE 1
+
+// Set non-zero if firmware image is LZ4 compressed (see firm_lz4.py)
+#define FIRMWARE_LZ4     1
+
+#if FIRMWARE_LZ4
+#define FIRMWARE_FNAME   "../firmware/brcmfmac43430-sdio-lz4.c"
+#else
+#define FIRMWARE_FNAME   "../firmware/brcmfmac43430-sdio.c"
+#endif
+
+// Length of firmware file (rounded up to 4-byte value), and its CRC32
+// (both are printed by firm_lz4.py)
+#define FIRMWARE_LEN    0x5ee84
+#define FIRMWARE_CRC32  0xcd4b2beb
+
+// Set non-zero to verify firmware by reading back from chip RAM
+#define FIRM_VERIFY     1
+
+// Size of each firmware download buffer (half of Tx buffer)
+#define FIRM_BUFF_LEN   (sizeof(txbuffer) / 2)
+
+// Compressed firmware: each block has a 2-byte little-endian header
+// giving the compressed length, with top bit set if block is stored raw
+// Block is decompressed to FIRM_LZ4_BLOCK bytes (less for the last block)
+// and the stream is terminated by a zero header
+#define FIRM_LZ4_BLOCK  0x2000
+#define FIRM_LZ4_RAW    0x8000
+
+// Set non-zero to skip firmware download if already running
+#define WARM_START      1
+
+// Firmware fingerprint: sample of image (in first buffer) checked in chip RAM
+#define FIRM_FPRINT_ADDR 0x1000
+#define FIRM_FPRINT_LEN  INIT_MAX_READ
+
+// Init program step operations
+#define INIT_END        0   // End of program
+#define INIT_CMD        1   // SD command (addr=num, val=arg)
+#define INIT_CMD_POLL   2   // SD command, repeat until response bits in mask are set
+#define INIT_SELECT     3   // Get card address (CMD3, repeat until response), select card (CMD7)
+#define INIT_WR         4   // Write register or backplane
+#define INIT_RD         5   // Read register or backplane, discard value
+#define INIT_OR         6   // Read, OR with value, write back
+#define INIT_POLL       7   // Read until (value & mask) == val, or timeout
+#define INIT_CALL       8   // Call function, fail if it returns zero
+#define INIT_DELAY      9   // Fixed delay
+#define INIT_SYNC       10  // Ordering barrier between queued reads & writes
+
+// CMD5 response: card ready
+#define SD_OCR_READY    0x80000000
+
+// Maximum read length of an init step
+#define INIT_MAX_READ   64
+
+// Init program step
+// func is SD_FUNC_BUS, SD_FUNC_BAK or SD_FUNC_RAD for registers,
+// or BAK_FUNC_WIN for backplane addresses accessed via the window
+typedef struct
+{
+    uint8_t op, func, nbytes;
+    uint32_t addr, mask, val;
+    int usec;
+    int (*fn)(void);
+} INIT_STEP;
+
+// Macros to define steps
+#define STEP_CMD(num, arg)                  {INIT_CMD, 0, 0, num, 0, arg, 0, 0}
+#define STEP_CMD_POLL(num, arg, mask, usec) {INIT_CMD_POLL, 0, 0, num, mask, arg, usec, 0}
+#define STEP_SELECT(usec)                   {INIT_SELECT, 0, 0, 0, 0, 0, usec, 0}
+#define STEP_WR(func, addr, val, n)         {INIT_WR, func, n, addr, 0, val, 0, 0}
+#define STEP_RD(func, addr, n)              {INIT_RD, func, n, addr, 0, 0, 0, 0}
+#define STEP_OR(func, addr, val, n)         {INIT_OR, func, n, addr, 0, val, 0, 0}
+#define STEP_POLL(func, addr, n, mask, val, usec) \
+                                            {INIT_POLL, func, n, addr, mask, val, usec, 0}
+#define STEP_CHECK(func, addr, n, mask, val) STEP_POLL(func, addr, n, mask, val, 0)
+#define STEP_CALL(f)                        {INIT_CALL, 0, 0, 0, 0, 0, 0, f}
+#define STEP_DELAY(usec)                    {INIT_DELAY, 0, 0, 0, 0, 0, usec, 0}
+#define STEP_SYNC()                         {INIT_SYNC, 0, 0, 0, 0, 0, 0, 0}
+#define STEP_END()                          {INIT_END, 0, 0, 0, 0, 0, 0, 0}
+
+// 32-bit backplane accesses
+#define STEP_WR32(addr, val)                STEP_WR(BAK_FUNC_WIN, addr, val, 4)
+#define STEP_RD32(addr)                     STEP_RD(BAK_FUNC_WIN, addr, 4)
+#define STEP_CHECK32(addr, mask, val)       STEP_CHECK(BAK_FUNC_WIN, addr, 4, mask, val)
+
+extern INIT_STEP sdio_start_steps[], sdio_warm_steps[];
+extern INIT_STEP sdio_cold_steps[], sdio_radio_steps[];
+extern int sdio_rca, init_fail_step, init_warm;
+extern uint8_t config_data[], txbuffer[0x4000];
+extern int config_len;
+
+int sdio_init(void);
+int init_run(INIT_STEP *steps);
+int init_step(INIT_STEP *sp);
+int init_read(int func, uint32_t addr, uint32_t *valp, int nbytes);
+int init_clk_tune(void);
+int init_fprint_check(void);
+void firm_open_read(int addr);
+int lz4_block_decode(const uint8_t *src, int hdr, uint8_t *dst, int dmax);
+void firm_read(uint8_t *dp, int len);
+void firm_read_start(uint8_t *dp, int len);
+int firm_read_poll(void);
+void firm_poll_hook(void);
+void firm_close(void);
+int write_firmware(void);
+int verify_firmware(void);
+int firm_find_error(void);
+int read_chip_ram(uint32_t addr, uint8_t *dp, int len);
+int write_nvram(void);
+void sd_setup(void);
+
+// EOF
@@ -19,23 +19,35 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "whd_types.h"
 #include "whd_wlioctl.h"
 #include "whd_events.h"
 
+#include "zw_gpio.h"
 #include "zw_sdio.h"
 #include "zw_regs.h"
 #include "zw_ioctl.h"
-#include "zw_gpio.h"
 
 #define IOCTL_POLL_MSEC     2
+#define ALIGN4(n)           (((n) + 3) & ~3)
 
-IOCTL_MSG ioctl_txmsg, ioctl_rxmsg;
+IOCTL_MSG ioctl_txmsg;
 int txglom;
 uint16_t ioctl_reqid=0;
-uint8_t event_mask[EVENT_MAX / 8];
-EVT_STR *current_evts;
+IOCTL_REQ ioctl_reqs[IOCTL_MAX_REQS];
+int ioctl_pending;
+IOCTL_POLICY ioctl_policy = {IOCTL_SPIN_USEC, IOCTL_BACKOFF_MIN, IOCTL_BACKOFF_MAX};
+IOCTL_STATS ioctl_stats = {.min_usec=~0U};
+IOCTL_BATCH_CMD ioctl_batch[IOCTL_BATCH_MAX];
+int ioctl_nbatch, ioctl_glom_frames;
+uint8_t ioctl_glom_buff[IOCTL_GLOM_MAX];
+uint8_t event_mask[EVENT_MAX / 8], event_refs[EVENT_MAX];
+int event_mask_sent, event_ioctls_avoided;
+char *evt_names[EVENT_MAX];
+EVT_HANDLER evt_handlers[EVENT_MAX];
+EVT_QUEUE evtq;
 char ioctl_event_hdr_fields[] =  
     "2:len 2: 1:seq 1:chan 1: 1:hdrlen 1:flow 1:credit";
 #define MAX_EVENT_STATUS 16
@@ -47,17 +59,26 @@ char *event_status[MAX_EVENT_STATUS] = {
 // Get event data, return data length excluding header
 int ioctl_get_event(IOCTL_EVENT_HDR *hp, uint8_t *data, int maxlen)
 {
-    int n=0, dlen=0, blklen;
+    int n=0, dlen=0, blklen, nblocks, err=0;
 
     hp->len = 0;
-    if (sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, (void *)hp, sizeof(IOCTL_EVENT_HDR)) &&
+    if (sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, (void *)hp, sizeof(IOCTL_EVENT_HDR)) > 0 &&
         hp->len>sizeof(IOCTL_EVENT_HDR) && hp->notlen>0 && hp->len==(hp->notlen^0xffff))
     {
         dlen = hp->len - sizeof(IOCTL_EVENT_HDR);
+        // Read whole blocks in one command, then the remainder in byte mode
+        nblocks = MIN(dlen, maxlen) / SD_RAD_BLK_BYTES;
+        if (nblocks > 0)
+        {
+            if (sdio_read_blocks(SD_FUNC_RAD, SB_32BIT_WIN, data, nblocks) != nblocks)
+                err = 1;
+            n = nblocks * SD_RAD_BLK_BYTES;
+        }
         while (n<dlen && n<maxlen)
         {
             blklen = MIN(MIN(maxlen-n, hp->len-n), IOCTL_MAX_BLKLEN);
-            sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, (void *)(&data[n]), blklen);
+            if (sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, (void *)(&data[n]), blklen) < 0)
+                err = 1;
             n += blklen;
         }
         while (n < dlen)
@@ -67,31 +88,204 @@ int ioctl_get_event(IOCTL_EVENT_HDR *hp, uint8_t *data, int maxlen)
             n += blklen;
         }
     }
+    // Discard the frame if there was a CRC error
+    if (err)
+        dlen = 0;
     return(dlen > maxlen ? maxlen : dlen);
 }
 
-// Enable events
+// Read frames from the chip into the event queue, until none left or queue full
+// Return the number of frames queued
+int evtq_receive(void)
+{
+    uint32_t frames = evtq.frames;
+
+    evtq.more = 0;
+    while (evtq_read_frame()) ;
+    return(evtq.frames - frames);
+}
+
+// Read a frame from the chip into the event queue
+// IOCTL responses are passed to the in-flight request table; if the queue
+// is full and a request is waiting, events are discarded to reach it
+// If stopped by a full queue, evtq.more is set, as the chip won't interrupt again
+// Return 0 if no frame, or queue full
+int evtq_read_frame(void)
+{
+    static EVT_SLOT spare;
+    EVT_SLOT *sp;
+    int n, full;
+
+    full = evtq.in - evtq.out >= EVTQ_SLOTS;
+    if (full && !ioctl_pending)
+    {
+        evtq.more = 1;
+        evtq.full++;
+        return(0);
+    }
+    sp = full ? &spare : &evtq.slots[evtq.in % EVTQ_SLOTS];
+    n = ioctl_get_event(&sp->hdr, sp->data, EVTQ_DATA_LEN);
+    if (sp->hdr.len == 0 || sp->hdr.len != (sp->hdr.notlen ^ 0xffff))
+        return(0);
+    sp->len = n;
+    if (n <= 0)
+    {
+        if (sp->hdr.len > sizeof(IOCTL_EVENT_HDR))
+            evtq.drops++;
+    }
+    else if (sp->hdr.chan == 0)
+        ioctl_response(sp);
+    else if (full)
+        evtq.lost++;
+    else
+    {
+        __sync_synchronize();
+        evtq.in++;
+        evtq.frames++;
+    }
+    return(1);
+}
+
+// Get the oldest frame in the event queue, without removing it
+// Return null if queue empty
+EVT_SLOT *evtq_get(void)
+{
+    if (evtq.in == evtq.out)
+        return(0);
+    __sync_synchronize();
+    return(&evtq.slots[evtq.out % EVTQ_SLOTS]);
+}
+
+// Release the oldest frame in the event queue
+void evtq_release(void)
+{
+    if (evtq.in != evtq.out)
+    {
+        __sync_synchronize();
+        evtq.out++;
+    }
+}
+
+// Return the number of frames in the event queue
+int evtq_count(void)
+{
+    return(evtq.in - evtq.out);
+}
+
+// Acknowledge chip interrupt status (write 1 to clear), return the status
+// Must be done before reading frames, so a frame arriving during the reads
+// will re-assert the interrupt
+uint32_t ioctl_irq_ack(void)
+{
+    uint32_t val=0;
+
+    sdio_bak_read32(SB_INT_STATUS_REG, &val);
+    if (val & 0xff)
+        sdio_bak_write32(SB_INT_STATUS_REG, val);
+    return(val);
+}
+
+// Enable events, replacing all subscriptions
 int ioctl_enable_evts(EVT_STR *evtp)
 {
-    current_evts = evtp;
-    memset(event_mask, 0, sizeof(event_mask));
-    while (evtp->num >= 0)
+    memset(event_refs, 0, sizeof(event_refs));
+    return(ioctl_subscribe_evts(evtp));
+}
+
+// Add a subscription to a list of events, update chip if mask has changed
+int ioctl_subscribe_evts(EVT_STR *evtp)
+{
+    for (; evtp->num >= 0; evtp++)
+    {
+        if (evtp->num < EVENT_MAX && event_refs[evtp->num] < 0xff)
+        {
+            event_refs[evtp->num]++;
+            evt_names[evtp->num] = evtp->str;
+        }
+    }
+    return(ioctl_update_evts());
+}
+
+// Remove a subscription to a list of events, update chip if mask has changed
+int ioctl_unsubscribe_evts(EVT_STR *evtp)
+{
+    for (; evtp->num >= 0; evtp++)
+    {
+        if (evtp->num < EVENT_MAX && event_refs[evtp->num] > 0)
+            event_refs[evtp->num]--;
+    }
+    return(ioctl_update_evts());
+}
+
+// Send event mask to chip, if it differs from the last mask sent
+int ioctl_update_evts(void)
+{
+    uint8_t mask[EVENT_MAX / 8] = {0};
+    int i;
+
+    for (i=0; i<EVENT_MAX; i++)
+    {
+        if (event_refs[i])
+            SET_EVENT(mask, i);
+    }
+    if (event_mask_sent && !memcmp(mask, event_mask, sizeof(mask)))
     {
-        if (evtp->num / 8 < sizeof(event_mask))
-            SET_EVENT(event_mask, evtp->num);
-        evtp++;
+        event_ioctls_avoided++;
+        return(1);
     }
-    return(ioctl_set_data("event_msgs", 0, event_mask, sizeof(event_mask)));
+    memcpy(event_mask, mask, sizeof(mask));
+    event_mask_sent = ioctl_set_data("event_msgs", 0, event_mask, sizeof(event_mask)) > 0;
+    return(event_mask_sent);
 }
 
 // Return string corresponding to event number, without "WLC_E_" prefix
 char *ioctl_evt_str(int event)
 {
-    EVT_STR *evtp=current_evts;
+    char *s = event>=0 && event<EVENT_MAX ? evt_names[event] : 0;
+
+    return(s && strlen(s)>6 ? &s[6] : "?");
+}
+
+// Set handler for an event number, return 0 if out of range
+int ioctl_evt_register(int event, EVT_HANDLER handler)
+{
+    if (event < 0 || event >= EVENT_MAX)
+        return(0);
+    evt_handlers[event] = handler;
+    return(1);
+}
+
+// Remove handler for an event number
+void ioctl_evt_unregister(int event)
+{
+    if (event >= 0 && event < EVENT_MAX)
+        evt_handlers[event] = 0;
+}
+
+// Call the handler for an event frame, with message fields byte-swapped
+// Return 0 if not an event, or no handler
+int ioctl_evt_dispatch(EVT_SLOT *sp)
+{
+    ETH_EVENT_FRAME *eep = (ETH_EVENT_FRAME *)sp->data;
+    int hlen = eep->event.data - sp->data, dlen;
+    struct whd_event_msg msg;
+    EVT_HANDLER handler;
 
-    while (evtp && evtp->num>=0 && evtp->num!=event)
-        evtp++;
-    return(evtp && evtp->num>=0 && strlen(evtp->str)>6 ? &evtp->str[6] : "?");
+    if (sp->len < hlen || SWAP16(eep->eth_hdr.ethertype) != 0x886c)
+        return(0);
+    msg = eep->event.msg;
+    msg.event_type = SWAP32(msg.event_type);
+    if (msg.event_type >= EVENT_MAX || (handler = evt_handlers[msg.event_type]) == 0)
+        return(0);
+    msg.version = SWAP16(msg.version);
+    msg.flags = SWAP16(msg.flags);
+    msg.status = SWAP32(msg.status);
+    msg.reason = SWAP32(msg.reason);
+    msg.auth_type = SWAP32(msg.auth_type);
+    msg.datalen = SWAP32(msg.datalen);
+    dlen = MIN(msg.datalen, sp->len - hlen);
+    handler(&msg, eep->event.data, dlen);
+    return(1);
 }
 
 // Return string corresponding to event status
@@ -149,68 +343,370 @@ int ioctl_rd_data(int cmd, int wait_msec, void *data, int len)
 }
 
 // Do an IOCTL transaction, get response, optionally waiting for it
+// Return the response frame length (including headers), 0 if error or timeout
 int ioctl_cmd(int cmd, char *name, int wait_msec, int wr, void *data, int dlen)
+{
+    return(ioctl_cmd_policy(cmd, name, wait_msec, wr, data, dlen, &ioctl_policy));
+}
+
+// Do an IOCTL transaction, waiting for the response using the given policy
+// Return the response frame length (including headers), 0 if error or timeout
+int ioctl_cmd_policy(int cmd, char *name, int wait_msec, int wr, void *data, int dlen,
+                     IOCTL_POLICY *pp)
+{
+    IOCTL_REQ *req;
+    int ret=0;
+
+    if ((req = ioctl_submit(cmd, name, wait_msec, wr, data, dlen, 0)) != 0)
+    {
+        ret = ioctl_req_wait(req, pp) == IOCTL_DONE ? req->rxlen : 0;
+        ioctl_release(req);
+    }
+    return(ret);
+}
+
+// Send an IOCTL request without waiting for the response
+// Return null if too long, no free request slot, or if the write failed and
+// the callback has been called (as the request has then been freed)
+IOCTL_REQ *ioctl_submit(int cmd, char *name, int wait_msec, int wr, void *data, int dlen,
+                        IOCTL_CALLBACK callback)
+{
+    IOCTL_REQ *req=0;
+    int txlen;
+
+    if (ioctl_msg_fits(name, wr, dlen) &&
+        (req = ioctl_req_alloc(cmd, wait_msec, wr, data, dlen, callback)) != 0)
+    {
+        txlen = ioctl_msg_build(&ioctl_txmsg, txglom, req->reqid, cmd, name, wr, data, dlen);
+        if (sdio_cmd53_write(SD_FUNC_RAD, SB_32BIT_WIN, (void *)&ioctl_txmsg, ALIGN4(txlen)) < 0)
+        {
+            ioctl_complete(req, IOCTL_ERROR);
+            if (callback)
+                req = 0;
+        }
+    }
+    return(req);
+}
+
+// Allocate an in-flight request with a new request ID, return null if none free
+IOCTL_REQ *ioctl_req_alloc(int cmd, int wait_msec, int wr, void *data, int dlen,
+                           IOCTL_CALLBACK callback)
+{
+    IOCTL_REQ *req = ioctl_reqs;
+
+    while (req < &ioctl_reqs[IOCTL_MAX_REQS] && req->reqid)
+        req++;
+    if (req >= &ioctl_reqs[IOCTL_MAX_REQS])
+        return(0);
+    // Request ID 0 marks a free slot
+    if (++ioctl_reqid == 0)
+        ioctl_reqid++;
+    req->reqid = ioctl_reqid;
+    req->cmd = cmd;
+    req->status = IOCTL_PENDING;
+    req->rxlen = 0;
+    req->data = wr ? 0 : data;
+    req->dlen = wr ? 0 : dlen;
+    req->start = ustime();
+    req->usec = IOCTL_WAIT_USEC + (MAX(wait_msec, 0) + IOCTL_POLL_MSEC) * 1000;
+    req->callback = callback;
+    ioctl_pending++;
+    return(req);
+}
+
+// Prepare IOCTL message, with glom header if required (marked as last frame)
+// Return message length, excluding padding to 4-byte boundary (which is zeroed)
+int ioctl_msg_build(IOCTL_MSG *msgp, int glom, uint16_t reqid, int cmd, char *name,
+                    int wr, void *data, int dlen)
 {
     static uint8_t txseq=1;
-    IOCTL_MSG *msgp = &ioctl_txmsg, *rsp = &ioctl_rxmsg;
-    IOCTL_CMD *cmdp = txglom ? &msgp->glom_cmd.cmd : &msgp->cmd;
-    int ret=0, namelen = name ? strlen(name)+1 : 0;
-    int txdlen = wr ? namelen + dlen : MAX(namelen, dlen);
-    int hdrlen = cmdp->data - (uint8_t *)&ioctl_txmsg;
-    int txlen = ((hdrlen + txdlen + 3) / 4) * 4; //, rxlen;
-    uint32_t val=0;
+    IOCTL_CMD *cmdp = glom ? &msgp->glom_cmd.cmd : &msgp->cmd;
+    int namelen = name ? strlen(name)+1 : 0;
+    int len = ioctl_msg_len(glom, name, wr, dlen);
 
-    // Prepare IOCTL command
-    memset(msgp, 0, sizeof(ioctl_txmsg));
-    memset(rsp, 0, sizeof(ioctl_rxmsg));
-    msgp->notlen = ~(msgp->len = hdrlen+txdlen);
-    if (txglom)
+    memset(msgp, 0, ALIGN4(len));
+    msgp->notlen = ~(msgp->len = len);
+    if (glom)
     {
-        msgp->glom_cmd.glom_hdr.len = hdrlen + txdlen - 4;
+        msgp->glom_cmd.glom_hdr.len = len - 4;
         msgp->glom_cmd.glom_hdr.flags = 1;
     }
     cmdp->seq = txseq++;
-    cmdp->hdrlen = txglom ? 20 : 12;
+    cmdp->hdrlen = glom ? 20 : 12;
     cmdp->cmd = cmd;
-    cmdp->outlen = txdlen;
-    cmdp->flags = ((uint32_t)++ioctl_reqid << 16) | (wr ? 2 : 0);
+    cmdp->outlen = len - (cmdp->data - (uint8_t *)msgp);
+    cmdp->flags = ((uint32_t)reqid << 16) | (wr ? 2 : 0);
     if (namelen)
         memcpy(cmdp->data, name, namelen);
     if (wr)
         memcpy(&cmdp->data[namelen], data, dlen);
-    // Send IOCTL command
-    sdio_cmd53_write(SD_FUNC_RAD, SB_32BIT_WIN, (void *)msgp, txlen);
-    ioctl_wait(IOCTL_WAIT_USEC);
-    while (wait_msec>=0 && ret==0)
+    return(len);
+}
+
+// Return IOCTL message length, excluding padding
+int ioctl_msg_len(int glom, char *name, int wr, int dlen)
+{
+    int namelen = name ? strlen(name)+1 : 0;
+    int hdrlen = glom ? offsetof(IOCTL_MSG, glom_cmd.cmd.data) : offsetof(IOCTL_MSG, cmd.data);
+
+    return(hdrlen + (wr ? namelen + dlen : MAX(namelen, dlen)));
+}
+
+// Return non-zero if command name & data fit in an IOCTL message
+int ioctl_msg_fits(char *name, int wr, int dlen)
+{
+    return(dlen >= 0 &&
+           ioctl_msg_len(0, name, wr, dlen) <= (int)offsetof(IOCTL_MSG, cmd.data) + IOCTL_MAX_BLKLEN);
+}
+
+// Enable or disable glommed IOCTL frames, return 0 if chip doesn't accept it
+int ioctl_glom_enable(int on)
+{
+    txglom = 0;
+    if (ioctl_set_uint32("bus:rxglom", 0, on ? 1 : 0))
+        txglom = on;
+    return(txglom == on);
+}
+
+// Start a batch of IOCTL commands
+void ioctl_batch_start(void)
+{
+    ioctl_nbatch = 0;
+}
+
+// Add an IOCTL command to the batch, return its index, or -1 if batch full
+// or command too long
+int ioctl_batch_add(int cmd, char *name, int wr, void *data, int dlen)
+{
+    IOCTL_BATCH_CMD *bp = &ioctl_batch[ioctl_nbatch];
+
+    if (ioctl_nbatch >= IOCTL_BATCH_MAX || !ioctl_msg_fits(name, wr, dlen))
+        return(-1);
+    bp->cmd = cmd;
+    bp->name = name;
+    bp->wr = wr;
+    bp->data = data;
+    bp->dlen = dlen;
+    bp->status = IOCTL_PENDING;
+    bp->req = 0;
+    if (wr && dlen <= IOCTL_BATCH_COPY)
+        bp->data = memcpy(bp->copy, data, dlen);
+    return(ioctl_nbatch++);
+}
+
+// Add IOCTL write with integer parameter to the batch
+int ioctl_batch_wr_int32(int cmd, int val)
+{
+    U32DATA u32 = {.uint32=(uint32_t)val};
+
+    return(ioctl_batch_add(cmd, 0, 1, u32.bytes, 4));
+}
+
+// Add IOCTL variable setting of 2 integers to the batch
+int ioctl_batch_set_intx2(char *name, int val1, int val2)
+{
+    int data[2] = {val1, val2};
+
+    return(ioctl_batch_add(WLC_SET_VAR, name, 1, data, 8));
+}
+
+// Send the batch of IOCTL commands, wait for all the responses
+// If glom is enabled, the commands are packed into superframes of up to
+// IOCTL_GLOM_MAX bytes, otherwise they are sent back-to-back
+// Return the number of successful commands, status of each is in ioctl_batch
+int ioctl_batch_run(int wait_msec)
+{
+    IOCTL_BATCH_CMD *bp;
+    IOCTL_MSG *msgp;
+    int n, len, first=0, last=0, txlen=0, ok=0;
+
+    for (n=0, bp=ioctl_batch; n<ioctl_nbatch; n++, bp++)
     {
-        // Wait for response to be available
-        wait_msec -= IOCTL_POLL_MSEC;
-        sdio_bak_read32(SB_INT_STATUS_REG, &val);
-        // If response is waiting..
-        if (val & 0xff)
+        if ((bp->req = ioctl_req_alloc(bp->cmd, wait_msec, bp->wr, bp->data, bp->dlen, 0)) == 0)
         {
-            // ..request response
-            sdio_bak_write32(SB_INT_STATUS_REG, val);
-            // Fetch response
-            ret = sdio_cmd53_read(SD_FUNC_RAD, SB_32BIT_WIN, (void *)rsp, txlen);
-            // Discard response if not matching request
-            if ((rsp->cmd.flags>>16) != ioctl_reqid)
-                ret = 0;
-            // Exit if error response
-            if (ret && (rsp->cmd.flags & 1))
-            {
-                ret = 0;
-                break;
-            }
-            // If OK, copy data to buffer
-            if (ret && !wr && data && dlen)
-                memcpy(data, rsp->cmd.data, dlen);
+            bp->status = IOCTL_ERROR;
+            continue;
+        }
+        len = ioctl_msg_len(1, bp->name, bp->wr, bp->dlen);
+        if (!txglom || len > IOCTL_GLOM_MAX)
+        {
+            // Send pending superframe first, so commands stay in order
+            if (txlen)
+                txlen = ioctl_glom_send(first, n, txlen);
+            len = ioctl_msg_build(&ioctl_txmsg, txglom, bp->req->reqid, bp->cmd,
+                                  bp->name, bp->wr, bp->data, bp->dlen);
+            if (sdio_cmd53_write(SD_FUNC_RAD, SB_32BIT_WIN, (void *)&ioctl_txmsg, ALIGN4(len)) < 0)
+                ioctl_complete(bp->req, IOCTL_ERROR);
+            continue;
         }
-        // If no response, wait
+        // Send superframe if no room, otherwise previous subframe isn't the last
+        if (txlen + ALIGN4(len) > IOCTL_GLOM_MAX)
+            txlen = ioctl_glom_send(first, n, txlen);
+        if (txlen == 0)
+            first = n;
         else
-            usdelay(IOCTL_POLL_MSEC * 1000);
+            ((IOCTL_MSG *)&ioctl_glom_buff[last])->glom_cmd.glom_hdr.flags = 0;
+        msgp = (IOCTL_MSG *)&ioctl_glom_buff[last = txlen];
+        len = ioctl_msg_build(msgp, 1, bp->req->reqid, bp->cmd, bp->name, bp->wr, bp->data, bp->dlen);
+        msgp->glom_cmd.glom_hdr.pad[0] = ALIGN4(len) - len;
+        txlen += ALIGN4(len);
     }
-    return(ret);
+    if (txlen)
+        ioctl_glom_send(first, ioctl_nbatch, txlen);
+    // Collect responses
+    for (n=0, bp=ioctl_batch; n<ioctl_nbatch; n++, bp++)
+    {
+        if (bp->req)
+        {
+            bp->status = ioctl_req_wait(bp->req, &ioctl_policy);
+            ioctl_release(bp->req);
+            bp->req = 0;
+        }
+        ok += bp->status == IOCTL_DONE;
+    }
+    return(ok);
+}
+
+// Send superframe containing batch commands first to last-1, return 0
+// If the write fails, complete the requests with an error
+int ioctl_glom_send(int first, int last, int txlen)
+{
+    IOCTL_BATCH_CMD *bp;
+
+    if (sdio_cmd53_write(SD_FUNC_RAD, SB_32BIT_WIN, ioctl_glom_buff, txlen) < 0)
+    {
+        for (bp=&ioctl_batch[first]; bp<&ioctl_batch[last]; bp++)
+        {
+            if (bp->req && bp->req->status == IOCTL_PENDING)
+                ioctl_complete(bp->req, IOCTL_ERROR);
+        }
+    }
+    ioctl_glom_frames++;
+    return(0);
+}
+
+// Receive any waiting frames, and time out requests with no response
+// Return the number of requests still waiting for a response
+int ioctl_poll(void)
+{
+    IOCTL_REQ *req;
+    int t = ustime();
+
+    ioctl_stats.polls++;
+    if ((ioctl_irq_ack() & 0xff) || evtq.more)
+        evtq_receive();
+    for (req=ioctl_reqs; req<&ioctl_reqs[IOCTL_MAX_REQS]; req++)
+    {
+        if (req->reqid && req->status==IOCTL_PENDING && t-req->start >= req->usec)
+            ioctl_complete(req, IOCTL_TIMEOUT);
+    }
+    return(ioctl_pending);
+}
+
+// Match IOCTL response frame to request, copy data, and complete it
+// Data copy is limited to the request buffer, and the part of the frame read
+// Responses with unknown request IDs are discarded
+void ioctl_response(EVT_SLOT *sp)
+{
+    IOCTL_MSG *rsp = (IOCTL_MSG *)&sp->hdr;
+    int n = sp->hdr.len - (rsp->cmd.data - (uint8_t *)rsp);
+    int avail = sp->len - (rsp->cmd.data - sp->data);
+    uint16_t reqid = rsp->cmd.flags >> 16;
+    IOCTL_REQ *req;
+
+    for (req=ioctl_reqs; req<&ioctl_reqs[IOCTL_MAX_REQS]; req++)
+    {
+        if (reqid && req->reqid==reqid && req->status==IOCTL_PENDING)
+        {
+            req->rxlen = sp->hdr.len;
+            n = MIN(MIN(n, req->dlen), avail);
+            if (!(rsp->cmd.flags & 1) && req->data && n > 0)
+                memcpy(req->data, rsp->cmd.data, n);
+            ioctl_complete(req, rsp->cmd.flags & 1 ? IOCTL_ERROR : IOCTL_DONE);
+            break;
+        }
+    }
+}
+
+// Set request status and latency, call the callback (if any) then free the request
+void ioctl_complete(IOCTL_REQ *req, int status)
+{
+    IOCTL_STATS *sp = &ioctl_stats;
+    uint32_t usec;
+    int n;
+
+    req->status = status;
+    req->latency = usec = ustime() - req->start;
+    if (status == IOCTL_TIMEOUT)
+        sp->timeouts++;
+    else
+    {
+        sp->count++;
+        sp->total_usec += usec;
+        sp->min_usec = MIN(sp->min_usec, usec);
+        sp->max_usec = MAX(sp->max_usec, usec);
+        for (n=0; n<IOCTL_HIST_BINS-1 && usec>=(IOCTL_HIST_USEC<<n); n++) ;
+        sp->hist[n]++;
+    }
+    ioctl_pending--;
+    if (req->callback)
+    {
+        req->callback(req);
+        ioctl_release(req);
+    }
+}
+
+// Free a request
+void ioctl_release(IOCTL_REQ *req)
+{
+    req->reqid = 0;
+}
+
+// Wait for a request (without callback) to complete, return its status
+// Spin on D1, reading the response directly as soon as it goes low (or if
+// frames were left in the chip), then if no response, poll the chip at
+// increasing intervals until response or timeout
+int ioctl_req_wait(IOCTL_REQ *req, IOCTL_POLICY *pp)
+{
+    int ticks, usec;
+
+    ustimeout(&ticks, 0);
+    while (req->status==IOCTL_PENDING && !ustimeout(&ticks, pp->spin_usec))
+    {
+        if (ioctl_ready() || evtq.more)
+            ioctl_read_direct(req);
+        else
+            sdio_wait_clock();
+    }
+    for (usec=pp->min_usec; req->status==IOCTL_PENDING; usec=MIN(usec*2, pp->max_usec))
+    {
+        if (ioctl_poll() && req->status==IOCTL_PENDING)
+        {
+            ustimeout(&ticks, 0);
+            while (!ustimeout(&ticks, usec))
+                sdio_wait_clock();
+        }
+    }
+    return(req->status);
+}
+
+// Read frames when D1 is low, without reading the interrupt status: clear the
+// frame indication (so a later frame re-asserts D1), then read until the request
+// completes; more frames may follow it, so flag them for the next receive
+// If there was no frame, and none were flagged as left in the chip, the
+// interrupt must be for something else, so poll
+void ioctl_read_direct(IOCTL_REQ *req)
+{
+    int n=0, more=evtq.more;
+
+    evtq.more = 0;
+    sdio_bak_write32(SB_INT_STATUS_REG, SB_INT_FRAME_IND);
+    while (req->status==IOCTL_PENDING && evtq_read_frame())
+        n++;
+    if (req->status != IOCTL_PENDING)
+        evtq.more = 1;
+    else if (n == 0 && !more)
+        ioctl_poll();
 }
 
 // Wait until IOCTL command has been processed
@@ -220,14 +716,44 @@ int ioctl_wait(int usec)
 
     ustimeout(&tout, 0);
     while (!ready && !ustimeout(&tout, usec))
-        ready = ioctl_ready();
+    {
+        if (!(ready = ioctl_ready()))
+            sdio_wait_clock();
+    }
     return(ready);
 }
 
-// Check if IOCTL command has been processed (data bit 1 low)
+// Check if IOCTL command has been processed (interrupt from chip)
 int ioctl_ready(void)
 {
-    return(!gpio_in(SD_D1_PIN));
+    return(sdio_irq());
+}
+
+// Clear IOCTL latency statistics
+void ioctl_stats_clear(void)
+{
+    memset(&ioctl_stats, 0, sizeof(ioctl_stats));
+    ioctl_stats.min_usec = ~0U;
+}
+
+// Display IOCTL latency statistics
+void ioctl_disp_stats(void)
+{
+    IOCTL_STATS *sp = &ioctl_stats;
+    int n;
+
+    printf("IOCTL latency: %u in %u polls, %u timeouts", sp->count, sp->polls, sp->timeouts);
+    if (sp->count)
+    {
+        printf(", mean %u min %u max %u usec\n ", sp->total_usec / sp->count,
+               sp->min_usec, sp->max_usec);
+        for (n=0; n<IOCTL_HIST_BINS; n++)
+        {
+            printf(" %s%u:%u", n<IOCTL_HIST_BINS-1 ? "<" : ">=",
+                   IOCTL_HIST_USEC << (n<IOCTL_HIST_BINS-1 ? n : n-1), sp->hist[n]);
+        }
+    }
+    printf("\n");
 }
 
 // Display fields in structure
@@ -85,6 +85,93 @@ typedef struct {
              reserved[2];
 } IOCTL_EVENT_HDR;
 
+// Event queue: single-producer single-consumer ring of received frames
+// The producer is the receive path, the consumer gets a pointer to the
+// oldest frame, and releases it when done
+#define EVTQ_SLOTS          8       // Number of slots, must be a power of 2
+#define EVTQ_DATA_LEN       1600    // Max frame length, excluding header
+
+// Frame header & data are contiguous, so a control frame can be viewed as IOCTL_MSG
+typedef struct {
+    int len;
+    IOCTL_EVENT_HDR hdr;
+    uint8_t data[EVTQ_DATA_LEN];
+} EVT_SLOT;
+
+typedef struct {
+    EVT_SLOT slots[EVTQ_SLOTS];
+    volatile uint32_t in, out;  // Free-running producer & consumer counts
+    int more;                   // Frames may be left in chip, without an interrupt
+    uint32_t frames,            // Frames queued
+             full,              // Reads stopped, as queue was full
+             drops,             // Frames discarded (CRC error)
+             lost;              // Events discarded when full, to get IOCTL response
+} EVT_QUEUE;
+
+// Asynchronous IOCTL request status
+#define IOCTL_PENDING       0
+#define IOCTL_DONE          1
+#define IOCTL_ERROR         (-1)
+#define IOCTL_TIMEOUT       (-2)
+
+// Max number of IOCTL requests in flight, and in a batch
+#define IOCTL_MAX_REQS      8
+#define IOCTL_BATCH_MAX     IOCTL_MAX_REQS
+
+// Max length of glommed superframe (one CMD53 byte-mode write)
+#define IOCTL_GLOM_MAX      512
+
+// In-flight IOCTL request, matched to response by request ID
+// If there is a callback, the request is freed after it is called,
+// otherwise the caller polls the status, then calls ioctl_release
+typedef struct ioctl_req IOCTL_REQ;
+typedef void (*IOCTL_CALLBACK)(IOCTL_REQ *req);
+struct ioctl_req {
+    uint16_t reqid;         // Request ID, 0 if free
+    int cmd,                // Command number
+        status,             // IOCTL_PENDING, IOCTL_DONE, or error
+        rxlen;              // Response frame length, including headers
+    uint8_t *data;          // Buffer for response data (read command)
+    int dlen;               // Length of response buffer
+    int start, usec,        // Time of submission, and timeout
+        latency;            // Time from submission to completion
+    IOCTL_CALLBACK callback;
+};
+
+// IOCTL completion policy: spin on D1 (interrupt from chip), then poll
+// the interrupt status at exponentially increasing intervals
+typedef struct {
+    int spin_usec,          // Time to spin on D1, 0 to go straight to polling
+        min_usec,           // First poll interval, doubled after each poll
+        max_usec;           // Max poll interval
+} IOCTL_POLICY;
+#define IOCTL_SPIN_USEC     1000
+#define IOCTL_BACKOFF_MIN   50
+#define IOCTL_BACKOFF_MAX   IOCTL_WAIT_USEC
+
+// IOCTL latency statistics, with log2 histogram from <64 to >=4096 usec
+#define IOCTL_HIST_BINS     8
+#define IOCTL_HIST_USEC     64
+typedef struct {
+    uint32_t count,         // Completed requests
+             timeouts,      // Requests with no response
+             polls,         // Interrupt status reads
+             total_usec, min_usec, max_usec,
+             hist[IOCTL_HIST_BINS];
+} IOCTL_STATS;
+
+// IOCTL command in a batch, with completion status
+// Short write data is copied into the command, so needn't be kept by caller
+#define IOCTL_BATCH_COPY    8
+typedef struct {
+    int cmd, wr, dlen, status;
+    char *name;
+    void *data;
+    IOCTL_REQ *req;
+    uint8_t copy[IOCTL_BATCH_COPY];
+} IOCTL_BATCH_CMD;
+#define ioctl_batch_status(n)   (ioctl_batch[n].status)
+
 #define SSID_MAXLEN         32
 
 #define EVENT_SET_SSID      0
@@ -98,6 +185,9 @@ typedef struct {
     int num;
     char *str;
 } EVT_STR;
+
+// Event handler, called with message fields in host byte order, and event data
+typedef void (*EVT_HANDLER)(struct whd_event_msg *msg, uint8_t *data, int dlen);
 #define EVT(e)      {e, #e}
 
 #define NO_EVTS     {EVT(-1)}
@@ -107,9 +197,29 @@ typedef struct {
 
 extern char ioctl_event_hdr_fields[];
 extern int txglom;
+extern EVT_QUEUE evtq;
+extern int event_ioctls_avoided;
+extern IOCTL_REQ ioctl_reqs[IOCTL_MAX_REQS];
+extern int ioctl_pending;
+extern IOCTL_BATCH_CMD ioctl_batch[IOCTL_BATCH_MAX];
+extern int ioctl_nbatch, ioctl_glom_frames;
+extern IOCTL_POLICY ioctl_policy;
+extern IOCTL_STATS ioctl_stats;
 
 int ioctl_get_event(IOCTL_EVENT_HDR *hp, uint8_t *data, int maxlen);
+int evtq_receive(void);
+int evtq_read_frame(void);
+uint32_t ioctl_irq_ack(void);
+EVT_SLOT *evtq_get(void);
+void evtq_release(void);
+int evtq_count(void);
 int ioctl_enable_evts(EVT_STR *evtp);
+int ioctl_subscribe_evts(EVT_STR *evtp);
+int ioctl_unsubscribe_evts(EVT_STR *evtp);
+int ioctl_update_evts(void);
+int ioctl_evt_register(int event, EVT_HANDLER handler);
+void ioctl_evt_unregister(int event);
+int ioctl_evt_dispatch(EVT_SLOT *sp);
 char *ioctl_evt_str(int event);
 char *ioctl_evt_status_str(int status);
 int ioctl_get_data(char *name, int wait_msec, uint8_t *data, int dlen);
@@ -118,9 +228,36 @@ int ioctl_set_intx2(char *name, int wait_msec, int val1, int val2);
 int ioctl_set_data(char *name, int wait_msec, void *data, int len);
 int ioctl_wr_int32(int cmd, int wait_msec, int val);
 int ioctl_wr_data(int cmd, int wait_msec, void *data, int len);
+// ioctl_cmd & ioctl_cmd_policy return the response frame length (including headers),
+// or 0 if error or timeout
 int ioctl_cmd(int cmd, char *name, int wait_msec, int wr, void *data, int dlen);
+int ioctl_cmd_policy(int cmd, char *name, int wait_msec, int wr, void *data, int dlen,
+                     IOCTL_POLICY *pp);
+int ioctl_req_wait(IOCTL_REQ *req, IOCTL_POLICY *pp);
+IOCTL_REQ *ioctl_submit(int cmd, char *name, int wait_msec, int wr, void *data, int dlen,
+                        IOCTL_CALLBACK callback);
+IOCTL_REQ *ioctl_req_alloc(int cmd, int wait_msec, int wr, void *data, int dlen,
+                           IOCTL_CALLBACK callback);
+int ioctl_msg_build(IOCTL_MSG *msgp, int glom, uint16_t reqid, int cmd, char *name,
+                    int wr, void *data, int dlen);
+int ioctl_msg_len(int glom, char *name, int wr, int dlen);
+int ioctl_msg_fits(char *name, int wr, int dlen);
+int ioctl_glom_enable(int on);
+void ioctl_batch_start(void);
+int ioctl_batch_add(int cmd, char *name, int wr, void *data, int dlen);
+int ioctl_batch_wr_int32(int cmd, int val);
+int ioctl_batch_set_intx2(char *name, int val1, int val2);
+int ioctl_batch_run(int wait_msec);
+int ioctl_glom_send(int first, int last, int txlen);
+int ioctl_poll(void);
+void ioctl_response(EVT_SLOT *sp);
+void ioctl_complete(IOCTL_REQ *req, int status);
+void ioctl_release(IOCTL_REQ *req);
+void ioctl_read_direct(IOCTL_REQ *req);
 int ioctl_wait(int usec);
 int ioctl_ready(void);
+void ioctl_stats_clear(void);
+void ioctl_disp_stats(void);
 void disp_fields(void *data, char *fields, int maxlen);
 
 // EOF
@@ -20,9 +20,11 @@
 #define BUS_IORDY_REG           0x003   // SDIOD_CCCR_IORDY         Ready indication
 #define BUS_INTEN_REG           0x004   // SDIOD_CCCR_INTEN
 #define BUS_INTPEND_REG         0x005   // SDIOD_CCCR_INTPEND
+#define BUS_IOABORT_REG         0x006   // SDIOD_CCCR_IOABORT       I/O abort & reset
 #define BUS_BI_CTRL_REG         0x007   // SDIOD_CCCR_BICTRL        Bus interface control
 #define BUS_SPEED_CTRL_REG      0x013   // SDIOD_CCCR_SPEED_CONTROL Bus speed control  
 #define BUS_BRCM_CARDCAP        0x0f0   // SDIOD_CCCR_BRCM_CARDCAP
+#define BUS_BRCM_CARDCTRL       0x0f1   // SDIOD_CCCR_BRCM_CARDCTRL
 #define BUS_BAK_BLKSIZE_REG     0x110   // SDIOD_CCCR_F1BLKSIZE_0   Backplane blocksize 
 #define BUS_RAD_BLKSIZE_REG     0x210   // SDIOD_CCCR_F2BLKSIZE_0   WiFi radio blocksize
 
@@ -32,6 +34,16 @@
 #define BAK_PULLUP_REG          0x1000f // SDIO_PULL_UP             Pullups
 #define BAK_WAKEUP_REG          0x1001e // SDIO_WAKEUP_CTRL
 
+// Bus I/O reset bit
+#define BUS_IO_RESET            0x08
+
+// Chip clock CSR bits
+#define CSR_ALP_REQ             0x08
+#define CSR_HT_REQ              0x10
+#define CSR_FORCE_ALP           0x20
+#define CSR_ALP_AVAIL           0x40
+#define CSR_HT_AVAIL            0x80
+
 // Silicon backplane
 #define BAK_BASE_ADDR           0x18000000              // CHIPCOMMON_BASE_ADDRESS
                                                         //
@@ -44,6 +56,7 @@
 #define SB_BASE_ADDR            (BAK_BASE_ADDR+0x2000)  // SDIO_BASE_ADDRESS
 #define SB_INT_STATUS_REG       (SB_BASE_ADDR +0x20)    // SDIO_INT_STATUS
 #define SB_INT_HOST_MASK_REG    (SB_BASE_ADDR +0x24)    // SDIO_INT_HOST_MASK
+#define SB_INT_FRAME_IND        0x40                    // I_HMB_FRAME_IND status bit
 #define SB_FUNC_INT_MASK_REG    (SB_BASE_ADDR +0x34)    // SDIO_FUNCTION_INT_MASK
 #define SB_TO_SB_MBOX_REG       (SB_BASE_ADDR +0x40)    // SDIO_TO_SB_MAILBOX
 #define SB_TO_SB_MBOX_DATA_REG  (SB_BASE_ADDR +0x48)    // SDIO_TO_SB_MAILBOX_DATA
@@ -16,11 +16,13 @@
 // limitations under the License.
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "zw_gpio.h"
+#include "zw_crc.h"
 #include "zw_sdio.h"
 #include "zw_regs.h"
 
@@ -28,12 +30,165 @@
 SDIO_MSG msglog[LOG_SIZE];
 int log_idx, log_start, logging;
 
-// CRC tables
-uint64_t qcrc16r_poly, qcrc16r_table[1 << SD_DATA_PINS];
-uint8_t crc7_table[256], clkval;
+// State of SDIO clock line
+uint8_t clkval;
+
+// Clock half-period, and pad drive strength
+int sd_clk_ns=SD_CLK_NSEC, sd_clk_cycles, sd_drive=SD_DRIVE;
+
+// Flag to defer CRC check until read is complete, and count of CRC errors
+int crc_deferred, crc_errors;
+
+// Function called while sending data blocks, to overlap other I/O
+void (*sdio_poll_hook)(void);
+
+// Interrupt callback, and flags set when armed & when the chip interrupts
+void (*sdio_irq_callback)(void);
+volatile int sdio_irq_armed, sdio_irq_flag;
+
+// Idle clock mode
+int sd_idle_mode=SD_IDLE_CONT;
+
+// Backplane batch operations, count of bus transfers & window changes
+BAK_OP bak_ops[BAK_MAX_OPS];
+int bak_nops, bak_xfers, bak_wins;
+
+// Current backplane window, all ones if unknown
+uint32_t bak_win_addr=~0;
+
+// Data output table: GPIO bank 1 clear & set values for each byte
+// (high nibble then low nibble, clock is cleared with the data)
+uint32_t dout_table[256][4];
+
+// Pin-mux profiles to switch data & command line direction
+GPIO_PROFILE sd_data_out = GPIO_PROFILE(SD_D0_PIN, SD_DATA_PINS, GPIO_OUT);
+GPIO_PROFILE sd_data_in  = GPIO_PROFILE(SD_D0_PIN, SD_DATA_PINS, GPIO_IN);
+GPIO_PROFILE sd_cmd_out  = GPIO_PROFILE(SD_CMD_PIN, 1, GPIO_OUT);
+GPIO_PROFILE sd_cmd_in   = GPIO_PROFILE(SD_CMD_PIN, 1, GPIO_IN);
 
 void gdb_break(void);
 
+// Bit-banged transport, and the transport in use
+SDIO_TRANSPORT sdio_bitbang = {"bitbang", sdio_cmd_rsp, sdio_bb_cmd53_read,
+    sdio_bb_cmd53_write, sdio_bb_read_blocks, sdio_bb_write_blocks, sdio_bb_irq};
+SDIO_TRANSPORT *sdio_bus = &sdio_bitbang;
+
+// Select the SDIO transport
+void sdio_set_transport(SDIO_TRANSPORT *tp)
+{
+    sdio_bus = tp;
+}
+
+// Do a command 53 write using the current transport
+int sdio_cmd53_write(int func, int addr, uint8_t *dp, int nbytes)
+{
+    sdio_irq_disarm();
+    return(sdio_bus->cmd53_write(func, addr, dp, nbytes));
+}
+
+// Do a command 53 read using the current transport
+int sdio_cmd53_read(int func, int addr, uint8_t *dp, int nbytes)
+{
+    sdio_irq_disarm();
+    return(sdio_bus->cmd53_read(func, addr, dp, nbytes));
+}
+
+// Read multiple blocks using the current transport
+int sdio_read_blocks(int func, int addr, uint8_t *dp, int nblocks)
+{
+    sdio_irq_disarm();
+    return(sdio_bus->read_blocks(func, addr, dp, nblocks));
+}
+
+// Write multiple blocks using the current transport
+int sdio_write_blocks(int func, int addr, uint8_t *dp, int nblocks)
+{
+    sdio_irq_disarm();
+    return(sdio_bus->write_blocks(func, addr, dp, nblocks));
+}
+
+// Return non-zero if the chip is signalling an interrupt
+int sdio_irq(void)
+{
+    return(sdio_bus->irq());
+}
+
+// Set clock half-period in nanoseconds
+void sdio_set_clk_ns(int nsec)
+{
+    sd_clk_ns = nsec;
+    sd_clk_cycles = ns_cycles(nsec);
+}
+
+// Set pad drive strength of SDIO pins
+void sdio_set_drive(int drive)
+{
+    sd_drive = drive;
+    gpio_drive(SD_CLK_PIN, drive);
+}
+
+// Check the bus is working at the current clock rate
+// Compares bus config registers (in one CMD53) with expected values, and reads
+// chip ID; fails if there is a data CRC error
+// Data write is checked by rewriting the backplane window (set to
+// the chipcommon base) with a CMD53, and reading it back
+int sdio_clk_check(uint32_t cccr, uint32_t chipid)
+{
+    U32DATA u32d, win={.uint32=(BAK_BASE_ADDR & SB_WIN_MASK) >> 8};
+    int n, errs=crc_errors;
+
+    for (n=0; n<SD_TUNE_CHECKS; n++)
+    {
+        if (sdio_cmd53_read(SD_FUNC_BUS, 0, u32d.bytes, 4) != 4 || u32d.uint32 != cccr ||
+            sdio_cmd53_read(SD_FUNC_BAK, SB_32BIT_WIN, u32d.bytes, 4) != 4 ||
+            u32d.uint32 != chipid || crc_errors != errs ||
+            sdio_cmd53_write(SD_FUNC_BAK, BAK_WIN_ADDR_REG, win.bytes, 3) != 3 ||
+            !sdio_cmd52_reads_check(SD_FUNC_BAK, BAK_WIN_ADDR_REG, 0xffffff, win.uint32, 3))
+            return(0);
+    }
+    return(1);
+}
+
+// Find fastest reliable clock, between given half-periods in nanoseconds
+// If drive is non-zero, the pad drive strength is increased if a check fails
+// The checks are done with CRC calculated during the transfer (not deferred)
+// and the clock is set one step slower than the fastest that passed, for margin
+// Backplane must be enabled, return the half-period that is set
+int sdio_clk_tune(int min_ns, int max_ns, int drive)
+{
+    uint32_t cccr, chipid;
+    int ns, ok, best=max_ns, defer=crc_deferred;
+    U32DATA u32d;
+
+    sdio_set_clk_ns(max_ns);
+    if (drive)
+        sdio_set_drive(SD_DRIVE);
+    crc_deferred = 0;
+    sdio_bak_window(BAK_BASE_ADDR);
+    if (sdio_cmd52_reads(SD_FUNC_BUS, 0, &cccr, 4) &&
+        sdio_cmd53_read(SD_FUNC_BAK, SB_32BIT_WIN, u32d.bytes, 4) == 4)
+    {
+        chipid = u32d.uint32;
+        for (ns=max_ns; ; ns=MAX(ns*SD_TUNE_STEP/100, min_ns))
+        {
+            sdio_set_clk_ns(ns);
+            while (!(ok = sdio_clk_check(cccr, chipid)) && drive && sd_drive<7)
+                sdio_set_drive(sd_drive + 1);
+            if (!ok)
+                break;
+            best = ns;
+            if (ns <= min_ns)
+                break;
+        }
+        best = MIN(best * 100 / SD_TUNE_STEP, max_ns);
+    }
+    sdio_set_clk_ns(best);
+    // Restore window, in case a failed write check corrupted it
+    sdio_cmd52_writes(SD_FUNC_BAK, BAK_WIN_ADDR_REG, (BAK_BASE_ADDR & SB_WIN_MASK) >> 8, 3);
+    crc_deferred = defer;
+    return(best);
+}
+
 // Read & check a value
 int sdio_cmd52_reads_check(int func, int addr, uint32_t mask, uint32_t val, int nbytes)
 {
@@ -48,11 +203,12 @@ int sdio_cmd7(int rca, SDIO_MSG *rsp)
     SDIO_MSG cmd={.cmd7 = {.start=0, .cmd=1, .num=7, 
         .rcax=SWAP16(rca), .x1=0, .crc=0, .stop=1}};
 
-    return(sdio_cmd_rsp(&cmd, rsp));
+    sdio_irq_disarm();
+    return(sdio_bus->cmd(&cmd, rsp));
 }
 
 // Write multiple 64-byte command 53 blocks (max 32K in total)
-int sdio_write_blocks(int func, int addr, uint8_t *dp, int nblocks)
+int sdio_bb_write_blocks(int func, int addr, uint8_t *dp, int nblocks)
 {
     int n=0;
     SDIO_MSG rspx, cmd={.cmd53 = {.start=0, .cmd=1, .num=53,
@@ -67,11 +223,8 @@ int sdio_write_blocks(int func, int addr, uint8_t *dp, int nblocks)
     if (sdio_rsp_read(rspx.data, MSG_BITS, SD_CMD_PIN))
     {
         log_msg(&rspx);
-        gpio_write(SD_D0_PIN, 4, 0xf);
-        gpio_mode(SD_D0_PIN, GPIO_OUT);
-        gpio_mode(SD_D1_PIN, GPIO_OUT);
-        gpio_mode(SD_D2_PIN, GPIO_OUT);
-        gpio_mode(SD_D3_PIN, GPIO_OUT);
+        GPIO_PINS_OUT(SD_D0_PIN, SD_DATA_PINS, 0xf);
+        gpio_profile_set(&sd_data_out);
         while (n++ < nblocks)
         {
             sdio_block_out(dp, SD_BAK_BLK_BYTES);
@@ -81,24 +234,34 @@ int sdio_write_blocks(int func, int addr, uint8_t *dp, int nblocks)
             dp += SD_BAK_BLK_BYTES;
             clk_0(2);
         }
-        gpio_mode(SD_D0_PIN, GPIO_IN);
-        gpio_mode(SD_D1_PIN, GPIO_IN);
-        gpio_mode(SD_D2_PIN, GPIO_IN);
-        gpio_mode(SD_D3_PIN, GPIO_IN);
+        gpio_profile_set(&sd_data_in);
     }
     clk_0(1);
     return(n);
 }
 
 // Set backplane window, don't set if already OK
+// Only the bytes that have changed are written
 void sdio_bak_window(uint32_t addr)
 {
-    static uint32_t lastaddr=0;
-    
+    uint32_t diff;
+    int i;
+
     addr &= SB_WIN_MASK;
-    if (addr != lastaddr)
-        sdio_cmd52_writes(SD_FUNC_BAK, BAK_WIN_ADDR_REG, addr>>8, 3);
-    lastaddr = addr;
+    diff = (addr ^ bak_win_addr) >> 8;
+    bak_wins += diff != 0;
+    for (i=0; i<3; i++)
+    {
+        if (diff & (0xff << i*8))
+            sdio_cmd52(SD_FUNC_BAK, BAK_WIN_ADDR_REG+i, (uint8_t)(addr >> (i+1)*8), SD_WR, 0, 0);
+    }
+    bak_win_addr = addr;
+}
+
+// Forget the backplane window setting, after the chip has been reset
+void sdio_bak_window_reset(void)
+{
+    bak_win_addr = ~0;
 }
 
 // Set backplane window, and return offset within window
@@ -121,16 +284,137 @@ int sdio_bak_write32(uint32_t addr, uint32_t val)
 int sdio_bak_read32(uint32_t addr, uint32_t *valp)
 {
     U32DATA u32d;
-    int n;
+    int n, retries=SD_CRC_RETRIES;
 
     sdio_bak_window(addr);
-    n = sdio_cmd53_read(SD_FUNC_BAK, addr | SB_32BIT_WIN, u32d.bytes, 4);
+    do {
+        n = sdio_cmd53_read(SD_FUNC_BAK, addr | SB_32BIT_WIN, u32d.bytes, 4);
+    } while (n==SD_CRC_ERR && retries--);
     *valp = u32d.uint32;
-    return(n);
+    return(n > 0 ? n : 0);
+}
+
+// Start a new batch of backplane operations
+void bak_batch_start(void)
+{
+    bak_nops = 0;
+}
+
+// Add 1 - 4 byte operation to the batch, return its index, -1 if full
+int bak_queue(int func, uint32_t addr, uint32_t val, int nbytes, int wr)
+{
+    BAK_OP *op = &bak_ops[bak_nops];
+
+    if (bak_nops >= BAK_MAX_OPS || nbytes > 4)
+        return(-1);
+    op->func = func;
+    op->addr = addr;
+    op->val = val;
+    op->nbytes = nbytes;
+    op->wr = wr;
+    op->ok = 0;
+    return(bak_nops++);
+}
+
+// Execute the batch, return number of operations completed OK
+// Operations are grouped by function & backplane window, keeping their
+// order within a group, so different groups must be independent
+// unless separated by a sync. Contiguous reads or writes are merged,
+// but not across a sync
+int bak_batch_run(void)
+{
+    uint8_t order[BAK_MAX_OPS], seg[BAK_MAX_OPS], done[BAK_MAX_OPS]={0};
+    int i, j, start, end, len, n=0, nok=0;
+    BAK_OP *op, *next;
+
+    for (start=0; start<bak_nops; start=end+1)
+    {
+        for (end=start; end<bak_nops && bak_ops[end].func!=BAK_FUNC_SYNC; end++) ;
+        for (i=start; i<end; i++)
+        {
+            if (done[i])
+                continue;
+            for (j=i; j<end; j++)
+            {
+                if (!done[j] && bak_same_group(&bak_ops[i], &bak_ops[j]))
+                {
+                    seg[n] = (uint8_t)start;
+                    order[n++] = (uint8_t)j;
+                    done[j] = 1;
+                }
+            }
+        }
+    }
+    for (i=0; i<n; i=j)
+    {
+        len = bak_ops[order[i]].nbytes;
+        for (j=i+1; j<n; j++)
+        {
+            op = &bak_ops[order[j-1]];
+            next = &bak_ops[order[j]];
+            if (seg[j]!=seg[i] || next->wr!=op->wr || !bak_same_group(op, next) ||
+                next->addr!=op->addr+op->nbytes || len+next->nbytes>BAK_MAX_XFER)
+                break;
+            len += next->nbytes;
+        }
+        nok += bak_xfer(&order[i], j-i, len);
+    }
+    return(nok);
+}
+
+// Return non-zero if two operations are in the same group
+int bak_same_group(BAK_OP *op1, BAK_OP *op2)
+{
+    return(op1->func==op2->func && (op1->func!=BAK_FUNC_WIN ||
+           (op1->addr & SB_WIN_MASK)==(op2->addr & SB_WIN_MASK)));
+}
+
+// Do a merged transfer for one or more operations, return number OK
+int bak_xfer(uint8_t *idx, int nops, int len)
+{
+    BAK_OP *op = &bak_ops[idx[0]];
+    int i, n, pos=0, func=op->func, addr=op->addr, retries=SD_CRC_RETRIES;
+    uint8_t buff[BAK_MAX_XFER];
+    SDIO_MSG rsp;
+
+    if (func == BAK_FUNC_WIN)
+    {
+        sdio_bak_window(addr);
+        addr = (addr & SB_ADDR_MASK) | (len%4 ? 0 : SB_32BIT_WIN);
+        func = SD_FUNC_BAK;
+    }
+    for (i=0; i<nops && op->wr; i++, pos+=op->nbytes)
+    {
+        op = &bak_ops[idx[i]];
+        memcpy(&buff[pos], &op->val, op->nbytes);
+    }
+    bak_xfers++;
+    if (op->wr)
+        n = len==1 ? sdio_cmd52(func, addr, buff[0], SD_WR, 0, 0) :
+            sdio_cmd53_write(func, addr, buff, len);
+    else
+    {
+        do {
+            n = len==1 ? sdio_cmd52(func, addr, 0, SD_RD, 0, &rsp) :
+                sdio_cmd53_read(func, addr, buff, len);
+        } while (n==SD_CRC_ERR && retries--);
+        buff[0] = len==1 ? rsp.rsp52.data : buff[0];
+    }
+    for (i=pos=0; i<nops; i++, pos+=op->nbytes)
+    {
+        op = &bak_ops[idx[i]];
+        op->ok = n > 0;
+        if (!op->wr)
+        {
+            op->val = 0;
+            memcpy(&op->val, &buff[pos], op->nbytes);
+        }
+    }
+    return(n > 0 ? nops : 0);
 }
 
 // Do a command 53 block write
-int sdio_cmd53_write(int func, int addr, uint8_t *dp, int nbytes)
+int sdio_bb_cmd53_write(int func, int addr, uint8_t *dp, int nbytes)
 {
     SDIO_MSG rspx, cmd={.cmd53 = {.start=0, .cmd=1, .num=53,
         .wr=1, .func=func, .blk=0, .inc=1, .addrh=(uint8_t)(addr>>15)&3,
@@ -150,7 +434,8 @@ int sdio_cmd53_write(int func, int addr, uint8_t *dp, int nbytes)
 }
 
 // Do a command 53 block read
-int sdio_cmd53_read(int func, int addr, uint8_t *dp, int nbytes)
+// Return SD_CRC_ERR if CRC is deferred, and the check fails
+int sdio_bb_cmd53_read(int func, int addr, uint8_t *dp, int nbytes)
 {
     SDIO_MSG rspx, cmd={.cmd53 = {.start=0, .cmd=1, .num=53,
         .wr=0, .func=func, .blk=0, .inc=1, .addrh=(uint8_t)(addr>>15)&3,
@@ -167,6 +452,48 @@ int sdio_cmd53_read(int func, int addr, uint8_t *dp, int nbytes)
     clk_0(1);
     log_msg(&rspx);
     log_data(dp, n, crc==0);
+    if (n && crc)
+    {
+        crc_errors++;
+        if (crc_deferred)
+            n = SD_CRC_ERR;
+    }
+    return(n);
+}
+
+// Read multiple command 53 blocks, return number of blocks
+// or SD_CRC_ERR if CRC is deferred, and a check fails
+int sdio_bb_read_blocks(int func, int addr, uint8_t *dp, int nblocks)
+{
+    int n=0, err=0, blksize=func==SD_FUNC_RAD ? SD_RAD_BLK_BYTES : SD_BAK_BLK_BYTES;
+    SDIO_MSG rspx, cmd={.cmd53 = {.start=0, .cmd=1, .num=53,
+        .wr=0, .func=func, .blk=1, .inc=1, .addrh=(uint8_t)(addr>>15)&3,
+        .addrm=(uint8_t)(addr>>7), .addrl=(uint8_t)(addr&0x7f),
+        .lenh=(uint8_t)(nblocks>>8)&1, .lenl=(uint8_t)nblocks, .crc=0, .stop=1}};
+    uint64_t crc;
+
+    clk_0(2);
+    add_crc7(cmd.data);
+    log_msg(&cmd);
+    sdio_cmd_write(cmd.data, MSG_BITS);
+    if (sdio_rsp_block_read(rspx.data, dp, blksize, &crc) == blksize)
+    {
+        log_msg(&rspx);
+        do
+        {
+            log_data(dp, blksize, crc==0);
+            err |= crc != 0;
+            dp = dp ? dp + blksize : 0;
+            n++;
+        } while (n < nblocks && sdio_block_read(dp, blksize, &crc) == blksize);
+    }
+    clk_0(1);
+    if (err)
+    {
+        crc_errors++;
+        if (crc_deferred)
+            n = SD_CRC_ERR;
+    }
     return(n);
 }
 
@@ -207,7 +534,8 @@ int sdio_cmd52(int func, int addr, uint8_t data, int wr, int raw, SDIO_MSG *rsp)
         .addrm=(uint8_t)(addr>>7 & 0xff), .addrl=(uint8_t)(addr&0x7f), .x2=0,
         .data=data, .crc=0, .stop=1}};
 
-    return(sdio_cmd_rsp(&cmd, rsp));
+    sdio_irq_disarm();
+    return(sdio_bus->cmd(&cmd, rsp));
 }
 
 // Send SD command, get response, return 0 if none
@@ -216,7 +544,8 @@ int sdio_cmd(int num, uint32_t arg, SDIO_MSG *rsp)
     SDIO_MSG cmd={.msg = {.start=0, .cmd=1, .num=num, 
         .argx=SWAP32(arg), .crc=0, .stop=1}};
 
-    return(sdio_cmd_rsp(&cmd, rsp));
+    sdio_irq_disarm();
+    return(sdio_bus->cmd(&cmd, rsp));
 }
 
 // Send SD command, return response length in bits
@@ -239,36 +568,37 @@ int sdio_cmd_rsp(SDIO_MSG *cmdp, SDIO_MSG *rsp)
 // Write command to SD interface
 void sdio_cmd_write(uint8_t *data, int nbits)
 {
-   uint8_t b, n;
+   uint8_t b=0, n;
 
-    gpio_mode(SD_CMD_PIN, GPIO_OUT);
+    gpio_profile_set(&sd_cmd_out);
     for (n=0; n<nbits; n++)
     {
         if (n%8 == 0)
             b = *data++;
-        gpio_out(SD_CMD_PIN, b & 0x80);
+        GPIO_PIN_OUT(SD_CMD_PIN, b & 0x80);
         b <<= 1;
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, 1);
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, 0);
+        SD_DELAY();
+        GPIO_PIN_SET(SD_CLK_PIN);
+        SD_DELAY();
+        GPIO_PIN_CLR(SD_CLK_PIN);
     }
-    gpio_mode(SD_CMD_PIN, GPIO_IN);
+    gpio_profile_set(&sd_cmd_in);
 }
 
 // Return response from chip
 int sdio_rsp_read(uint8_t *rsp, int nbits, int pin)
 {
-    uint8_t wt=RSP_WAIT, n=0, r=1;
+    volatile uint32_t *lev1=GPIO_BANK(GPIO_LEV0, SD_CMD_PIN);
+    uint8_t wt=RSP_WAIT, n=0, r=1, shift=pin % 32;
 
     *rsp = 0;
     while (wt-- && r)
     {
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, 1);
-        r = gpio_in(pin);
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, 0);
+        SD_DELAY();
+        GPIO_PIN_SET(SD_CLK_PIN);
+        r = *lev1 >> shift & 1;
+        SD_DELAY();
+        GPIO_PIN_CLR(SD_CLK_PIN);
     }
     if (r == 0)
     {
@@ -276,11 +606,11 @@ int sdio_rsp_read(uint8_t *rsp, int nbits, int pin)
         {
             if (n%8 == 0)
                 *++rsp = 0;
-            usdelay(SD_CLK_DELAY);
-            gpio_out(SD_CLK_PIN, 1);
-            *rsp = (*rsp << 1) | gpio_in(pin);
-            usdelay(SD_CLK_DELAY);
-            gpio_out(SD_CLK_PIN, 0);
+            SD_DELAY();
+            GPIO_PIN_SET(SD_CLK_PIN);
+            *rsp = (*rsp << 1) | (*lev1 >> shift & 1);
+            SD_DELAY();
+            GPIO_PIN_CLR(SD_CLK_PIN);
         }
     }
     return(n);
@@ -292,16 +622,10 @@ int sdio_rsp_block_write(uint8_t *rsp, uint8_t *dp, int nbytes)
     if (sdio_rsp_read(rsp, MSG_BITS, SD_CMD_PIN))
     {
         clk_0(1);
-        gpio_write(SD_D0_PIN, 4, 0xff);
-        gpio_mode(SD_D0_PIN, GPIO_OUT);
-        gpio_mode(SD_D1_PIN, GPIO_OUT);
-        gpio_mode(SD_D2_PIN, GPIO_OUT);
-        gpio_mode(SD_D3_PIN, GPIO_OUT);
+        GPIO_PINS_OUT(SD_D0_PIN, SD_DATA_PINS, 0xf);
+        gpio_profile_set(&sd_data_out);
         sdio_block_out(dp, nbytes);
-        gpio_mode(SD_D0_PIN, GPIO_IN);
-        gpio_mode(SD_D1_PIN, GPIO_IN);
-        gpio_mode(SD_D2_PIN, GPIO_IN);
-        gpio_mode(SD_D3_PIN, GPIO_IN);
+        gpio_profile_set(&sd_data_in);
     }
     else
         nbytes = 0;
@@ -309,148 +633,326 @@ int sdio_rsp_block_write(uint8_t *rsp, uint8_t *dp, int nbytes)
     return(nbytes);
 }
 
+// Output byte as 2 nibbles using the data output table: clock goes low
+// as the data is changed, and high when it is stable, each for a half-period
+#define DOUT_BYTE(b) {uint32_t *tp=dout_table[b]; \
+    *clr1 = tp[0]; *set1 = tp[1]; SD_DELAY(); *set1 = SD_CLK_BIT; SD_DELAY(); \
+    *clr1 = tp[2]; *set1 = tp[3]; SD_DELAY(); *set1 = SD_CLK_BIT; SD_DELAY();}
+
 // Send block of data with CRC
 // (assumes command 53 sent, response received, and O/P set)
 void sdio_block_out(uint8_t *dp, int nbytes)
 {
-    int dbits=0, n;
+    volatile uint32_t *set1=GPIO_REG(GPIO_SET0)+1, *clr1=GPIO_REG(GPIO_CLR0)+1;
+    uint32_t w, *wp;
     uint64_t qcrc=0;
-    uint8_t d;
+    uint8_t b;
+    int n, nwords=0;
 
     clk_0(1);
-    gpio_write(SD_D0_PIN, 4, 0);
+    GPIO_PINS_OUT(SD_D0_PIN, SD_DATA_PINS, 0);
     clk_0(1);
-    while (dbits < nbytes*8)
+    // Leading bytes, until word-aligned
+    while (nbytes > 0 && ((uintptr_t)dp & 3))
     {
-        d = dbits%8 ? dp[dbits/8] & 0xf : dp[dbits/8] >> 4;
-        gpio_write(SD_D0_PIN, 4, d);
-        gpio_out(SD_CLK_PIN, 1);
-        //clk_0(1);
-        qcrc = qcrc >> SD_DATA_PINS ^ qcrc16r_table[(d ^ (uint8_t)qcrc) & 0xf];
-        dbits += 4;
-        gpio_out(SD_CLK_PIN, 0);
+        b = *dp++;
+        DOUT_BYTE(b);
+        QCRC_BYTE(qcrc, b);
+        nbytes--;
     }
-    for (n=0; n<16; n++)
+    // Stream 32-bit words, l.s.byte first, calling the poll hook
+    // every SD_POLL_BYTES, counted from the first word
+    wp = (uint32_t *)dp;
+    while (nbytes >= 4)
     {
-        gpio_write(SD_D0_PIN, 4, (uint8_t)qcrc & 0xf);
-        gpio_out(SD_CLK_PIN, 1);
-        qcrc >>= 4;
-        //clk_0(1);
-        gpio_out(SD_CLK_PIN, 0);
+        if (sdio_poll_hook && nwords++ % (SD_POLL_BYTES/4) == 0)
+            sdio_poll_hook();
+        w = *wp++;
+        QCRC_WORD(qcrc, w);
+        for (n=0; n<4; n++, w>>=8)
+        {
+            b = (uint8_t)w;
+            DOUT_BYTE(b);
+        }
+        nbytes -= 4;
     }
-    gpio_write(SD_D0_PIN, 4, 0xf);
+    // Trailing bytes
+    dp = (uint8_t *)wp;
+    while (nbytes-- > 0)
+    {
+        b = *dp++;
+        DOUT_BYTE(b);
+        QCRC_BYTE(qcrc, b);
+    }
+    // CRC, 2 nibbles per byte, l.s.nibble first
+    for (n=0; n<8; n++)
+    {
+        b = (uint8_t)(qcrc << 4) | (uint8_t)(qcrc >> 4 & 0xf);
+        DOUT_BYTE(b);
+        qcrc >>= 8;
+    }
+    *clr1 = SD_CLK_BIT;
+    GPIO_PINS_OUT(SD_D0_PIN, SD_DATA_PINS, 0xf);
     clk_0(1);
 }
 
+// Clock cycle, sampling GPIO bank 1 levels on the rising edge
+#define CLK_SAMPLE(lev) {SD_DELAY(); *set1 = SD_CLK_BIT; lev = *lev1; \
+    SD_DELAY(); *clr1 = SD_CLK_BIT;}
+#define LEV_CMD(lev)    ((lev) >> (SD_CMD_PIN % 32) & 1)
+#define LEV_DATA(lev)   ((lev) >> (SD_D0_PIN % 32) & 0xf)
+
 // Return response & data block from a command 53 read
+// If CRC is deferred, the data is captured without CRC calculation,
+// and checked after the transfer is complete (not if data is discarded)
 int sdio_rsp_block_read(uint8_t *rsp, uint8_t *dp, int nbytes, uint64_t *crcp)
 {
-    int wt=RSP_WAIT, rbits=1, dbits=0, din=0;
-    uint8_t r=1, d=0xf;
+    volatile uint32_t *set1=GPIO_REG(GPIO_SET0)+1, *clr1=GPIO_REG(GPIO_CLR0)+1;
+    volatile uint32_t *lev1=GPIO_REG(GPIO_LEV0)+1;
+    int wt=RSP_WAIT, rbits=1, din=0, nd=0, ndata=nbytes*2, defer=crc_deferred && dp;
+    uint32_t lev=SD_CMD_BIT;
     uint64_t qcrc=0;
+    uint8_t d, *p, crcd[SD_DATA_PINS*2];
 
     *rsp = 0;
-    if (dp)
-        *dp = 0;
-    while (wt-- && r)
+    // Wait for response start bit
+    while (wt-- && (lev & SD_CMD_BIT))
+        CLK_SAMPLE(lev);
+    if ((lev & SD_CMD_BIT) == 0)
     {
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, 1);
-        r = gpio_in(SD_CMD_PIN);
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, 0);
-    }
-    if (r == 0)
-    {
-        while (rbits<MSG_BITS || din)
+        // Get response, checking for data start bit
+        while (rbits < MSG_BITS)
         {
-            usdelay(SD_CLK_DELAY);
-            gpio_out(SD_CLK_PIN, 1);
-            if (rbits < MSG_BITS)
-            {
-                if (rbits % 8 == 0)
-                    *++rsp = 0;
-                *rsp = (*rsp<<1) | gpio_in(SD_CMD_PIN);
-                rbits++;
-            }
-            if (din==0 && gpio_read(SD_D0_PIN, SD_DATA_PINS)==0)
+            CLK_SAMPLE(lev);
+            if (rbits++ % 8 == 0)
+                *++rsp = 0;
+            *rsp = (*rsp << 1) | LEV_CMD(lev);
+            d = LEV_DATA(lev);
+            if (!din && d==0)
                 din = 1;
-            else if (din)
+            else if (din && nd<ndata+sizeof(crcd)*2)
             {
-                d = gpio_read(SD_D0_PIN, SD_DATA_PINS);
-                if (dp && dbits/8 < nbytes)
-                    *dp = (*dp << SD_DATA_PINS) | d;
-                qcrc = qcrc >> SD_DATA_PINS ^ qcrc16r_table[(d ^ (uint8_t)qcrc) & 0xf];
-                dbits += SD_DATA_PINS;
-                if (dbits/8 >= nbytes + SD_DATA_PINS*2)
-                    din = 0;
-                else if (dp && dbits/8 < nbytes && dbits%8 == 0)
-                    *++dp = 0;
+                p = nd < ndata ? (dp ? &dp[nd/2] : 0) : &crcd[nd/2 - nbytes];
+                if (p)
+                    *p = nd & 1 ? *p << SD_DATA_PINS | d : d;
+                if (!defer && nd < ndata)
+                    QCRC_NIBBLE(qcrc, d);
+                nd++;
             }
-            usdelay(SD_CLK_DELAY);
-            gpio_out(SD_CLK_PIN, 0);
+        }
+        // If data has started, stream the rest as whole bytes
+        if (din && (nd & 1))
+        {
+            CLK_SAMPLE(lev);
+            d = LEV_DATA(lev);
+            p = nd < ndata ? (dp ? &dp[nd/2] : 0) : &crcd[nd/2 - nbytes];
+            if (p)
+                *p = *p << SD_DATA_PINS | d;
+            if (!defer && nd < ndata)
+                QCRC_NIBBLE(qcrc, d);
+            nd++;
+        }
+        if (din)
+        {
+            qcrc = sdio_data_in(dp, nbytes, nd, qcrc, crcd);
+            nd = ndata + sizeof(crcd)*2;
         }
     }
     *crcp = qcrc;
-    dbits -= SD_DATA_PINS*2*8;
-    return(dbits>0 ? dbits/8 : 0);
+    nd -= sizeof(crcd)*2;
+    return(nd>0 ? nd/2 : 0);
 }
 
-// Toggle clock, leave it at 0
-void clk_0(int cycles)
+// Read a data block without a response, return data length
+// (used for the 2nd and subsequent blocks of a multi-block read)
+int sdio_block_read(uint8_t *dp, int nbytes, uint64_t *crcp)
 {
-    while (cycles--)
+    volatile uint32_t *set1=GPIO_REG(GPIO_SET0)+1, *clr1=GPIO_REG(GPIO_CLR0)+1;
+    volatile uint32_t *lev1=GPIO_REG(GPIO_LEV0)+1;
+    uint32_t lev=SD_DATA_BITS;
+    uint8_t crcd[SD_DATA_PINS*2];
+    int wt=DATA_WAIT;
+
+    // Wait for data start bit
+    while (wt-- && LEV_DATA(lev))
+        CLK_SAMPLE(lev);
+    if (LEV_DATA(lev))
+        return(0);
+    *crcp = sdio_data_in(dp, nbytes, 0, 0, crcd);
+    return(nbytes);
+}
+
+// Read the rest of a data block and its CRC, starting at nibble nd (even)
+// If CRC is deferred, and data is kept, it is checked after the transfer
+// Return CRC check value, zero if OK
+uint64_t sdio_data_in(uint8_t *dp, int nbytes, int nd, uint64_t qcrc, uint8_t *crcd)
+{
+    volatile uint32_t *set1=GPIO_REG(GPIO_SET0)+1, *clr1=GPIO_REG(GPIO_CLR0)+1;
+    volatile uint32_t *lev1=GPIO_REG(GPIO_LEV0)+1;
+    int ndata=nbytes*2, ncrc=SD_DATA_PINS*2, defer=crc_deferred && dp;
+    uint32_t lev, lev2;
+    uint8_t b, *p = dp ? &dp[nd/2] : 0;
+
+    if (defer)
     {
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, clkval=!clkval);
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, clkval=!clkval);
+        while (nd < ndata)
+        {
+            CLK_SAMPLE(lev);
+            CLK_SAMPLE(lev2);
+            b = (uint8_t)(LEV_DATA(lev) << SD_DATA_PINS | LEV_DATA(lev2));
+            if (p)
+                *p++ = b;
+            nd += 2;
+        }
     }
-    if (clkval)
+    else
+    {
+        while (nd < ndata)
+        {
+            CLK_SAMPLE(lev);
+            CLK_SAMPLE(lev2);
+            b = (uint8_t)(LEV_DATA(lev) << SD_DATA_PINS | LEV_DATA(lev2));
+            if (p)
+                *p++ = b;
+            QCRC_BYTE(qcrc, b);
+            nd += 2;
+        }
+    }
+    while (nd < ndata+ncrc*2)
     {
-        usdelay(SD_CLK_DELAY);
-        gpio_out(SD_CLK_PIN, clkval=!clkval);
+        CLK_SAMPLE(lev);
+        CLK_SAMPLE(lev2);
+        crcd[nd/2 - nbytes] = (uint8_t)(LEV_DATA(lev) << SD_DATA_PINS | LEV_DATA(lev2));
+        nd += 2;
     }
+    // Check CRC, which should be zero if data is OK
+    if (defer)
+        qcrc = qcrc16r_data(0, dp, nbytes);
+    qcrc = qcrc16r_data(qcrc, crcd, ncrc);
+    return(qcrc);
+}
 
+// Check for interrupt (data bit 1 low)
+int sdio_bb_irq(void)
+{
+    return(!GPIO_PIN_IN(SD_D1_PIN));
 }
 
-// Initialise CRC7 calculator
-void crc7_init(void)
+// Attach handler to GPIO interrupt, with optional callback
+void sdio_irq_init(void (*callback)(void))
 {
-    int i;
+    sdio_irq_callback = callback;
+    sdio_irq_armed = sdio_irq_flag = 0;
+    gpio_fall_detect(SD_D1_PIN, 0);
+    CPU_irq_attach(IRQ_GPIO_BANK1, sdio_irq_handler);
+    CPU_irq_enable();
+}
 
-    for (i=0; i<256; i++)
-        crc7_table[i] = crc7_byte(i);
+// Arm falling-edge detect on data bit 1, when the bus is idle
+// (D1 also carries data during transfers, so is disarmed by every transaction)
+// If the interrupt is already asserted, there will be no edge, so call handler
+void sdio_irq_arm(void)
+{
+    sdio_irq_flag = 0;
+    sdio_irq_armed = 1;
+    gpio_fall_detect(SD_D1_PIN, 1);
+    if (!GPIO_PIN_IN(SD_D1_PIN))
+        sdio_irq_handler();
 }
 
-// Add CRC and stop bit to message
-void add_crc7(uint8_t *data)
+// Disarm falling-edge detect at the start of a bus transaction
+// Clearing the flag first stops the idle clock timer toggling CLK mid-transfer
+void sdio_irq_disarm(void)
 {
-    data[MSG_BYTES-1] = crc7_data(data, MSG_BYTES-1);
+    if (sdio_irq_armed)
+    {
+        sdio_irq_armed = 0;
+        gpio_fall_detect(SD_D1_PIN, 0);
+    }
 }
 
-// Calculate 7-bit CRC of byte, return as bits 1-7
-uint8_t crc7_byte(uint8_t b)
+// Handle GPIO interrupt: disarm, clear event, flag chip interrupt
+void sdio_irq_handler(void)
 {
-    uint16_t n, w=b;
+    gpio_fall_detect(SD_D1_PIN, 0);
+    if (sdio_irq_armed)
+    {
+        sdio_irq_armed = 0;
+        sdio_irq_flag = 1;
+        if (sdio_irq_callback)
+            sdio_irq_callback();
+    }
+}
 
-    for (n=0; n<8; n++)
+// Set idle clock mode, return the mode in use
+// Timer mode falls back to clocking while waiting, if no timer interrupt
+int sdio_idle_mode(int mode)
+{
+    if (sd_idle_mode == SD_IDLE_TIMER)
+        timer_irq_stop();
+    if (mode == SD_IDLE_TIMER && !timer_irq_start(SD_IDLE_USEC, sdio_idle_clock))
+        mode = SD_IDLE_WAIT;
+    return(sd_idle_mode = mode);
+}
+
+// Called from application loop: clock the bus if in continuous mode
+void sdio_idle(void)
+{
+    if (sd_idle_mode == SD_IDLE_CONT)
+        sdio_wait_clock();
+}
+
+// Timer callback: toggle clock if the bus is idle (armed, no transaction)
+void sdio_idle_clock(void)
+{
+    if (sdio_irq_armed)
+        GPIO_PIN_OUT(SD_CLK_PIN, clkval=!clkval);
+}
+
+// Clock the bus while the driver is waiting
+void sdio_wait_clock(void)
+{
+    usdelay(SD_CLK_DELAY);
+    GPIO_PIN_OUT(SD_CLK_PIN, clkval=!clkval);
+}
+
+// Wait for interrupt from chip, with timeout; return non-zero if interrupt
+// The timer provides the clock in timer mode, otherwise clock while waiting
+int sdio_idle_wait(int usec)
+{
+    int ticks;
+
+    ustimeout(&ticks, 0);
+    while (!sdio_irq_flag && !ustimeout(&ticks, usec))
     {
-        w <<= 1;
-        if (w & 0x100)
-            w ^= CRC7_POLY;
+        if (sd_idle_mode != SD_IDLE_TIMER)
+            sdio_wait_clock();
     }
-    return((uint8_t)w);
+    return(sdio_irq_flag);
 }
 
-// Calculate 7-bit CRC of data bytes, with l.s.bit as stop bit
-uint8_t crc7_data(uint8_t *data, int n)
+// Toggle clock, leave it at 0
+void clk_0(int cycles)
 {
-    uint8_t crc=0;
+    while (cycles--)
+    {
+        SD_DELAY();
+        GPIO_PIN_OUT(SD_CLK_PIN, clkval=!clkval);
+        SD_DELAY();
+        GPIO_PIN_OUT(SD_CLK_PIN, clkval=!clkval);
+    }
+    if (clkval)
+    {
+        SD_DELAY();
+        GPIO_PIN_OUT(SD_CLK_PIN, clkval=!clkval);
+    }
+
+}
 
-    while (n--)
-        crc = crc7_table[crc ^ *data++];
-    return(crc | 1);
+// Add CRC and stop bit to message
+void add_crc7(uint8_t *data)
+{
+    data[MSG_BYTES-1] = crc7_data(data, MSG_BYTES-1);
 }
 
 // Dump data as byte values
@@ -471,28 +973,18 @@ void dump_msg(uint8_t *data)
     printf("\n");
 }
 
-// Initialise bit-reversed CRC16 lookup table for 4-bit values
-void qcrc16r_init(void)
-{
-    qcrc16r_poly = quadval(CRC16R_POLY);
-    int i;
-
-    for (i=0; i<(1<<SD_DATA_PINS); i++)
-        qcrc16r_table[i]  = (i & 8 ? qcrc16r_poly<<3 : 0) |
-                            (i & 4 ? qcrc16r_poly<<2 : 0) |
-                            (i & 2 ? qcrc16r_poly<<1 : 0) |
-                            (i & 1 ? qcrc16r_poly<<0 : 0);
-}
-
-// Spread a 16-bit value to occupy 64 bits
-uint64_t quadval(uint16_t val)
+// Initialise data output table
+void dout_init(void)
 {
-    uint64_t ret=0;
     int i;
 
-    for (i=0; i<16; i++)
-        ret |= val & (1<<i) ? 1LL<<(i*4) : 0;
-    return(ret);
+    for (i=0; i<256; i++)
+    {
+        dout_table[i][0] = SD_DATA_CLR(i >> 4) | SD_CLK_BIT;
+        dout_table[i][1] = SD_DATA_SET(i >> 4);
+        dout_table[i][2] = SD_DATA_CLR(i & 0xf) | SD_CLK_BIT;
+        dout_table[i][3] = SD_DATA_SET(i & 0xf);
+    }
 }
 
 // Display command or response
@@ -502,8 +994,8 @@ void disp_msg(SDIO_MSG *smf)
 
     disp_bytes(smf->data, MSG_BYTES);
     printf("%s ", smf->data[MSG_BYTES-1] == crc ? "*" : "?");
-    printf("%s %2u %08lX", smf->msg.cmd ? "Cmd" : "Rsp", 
-           smf->msg.num, SWAP32(smf->msg.argx));
+    printf("%s %2u %08" PRIX32, smf->msg.cmd ? "Cmd" : "Rsp", 
+           smf->msg.num, (uint32_t)SWAP32(smf->msg.argx));
     if (smf->msg.num==52)
     {
         if (smf->msg.cmd)
@@ -553,6 +1045,12 @@ void disp_rsp53(SDIO_MSG *smf)
     printf(" Flags %02X", smf->rsp52.flags);
 }
 
+// Enable / disable deferred CRC check on data reads
+void sdio_crc_defer(int on)
+{
+    crc_deferred = on;
+}
+
 // Enable / disable logging
 void log_enable(int on)
 {
@@ -31,16 +31,19 @@
 #define SD_D3_PIN    39
 #define SD_DATA_PINS 4
 
+// Bit masks for pins in GPIO bank 1 (pins 32 - 63)
+#define SD_CLK_BIT   (1 << (SD_CLK_PIN % 32))
+#define SD_CMD_BIT   (1 << (SD_CMD_PIN % 32))
+#define SD_DATA_BITS (((1 << SD_DATA_PINS) - 1) << (SD_D0_PIN % 32))
+#define SD_DATA_SET(d)  ((uint32_t)(d) << (SD_D0_PIN % 32))
+#define SD_DATA_CLR(d)  (SD_DATA_SET(~(d)) & SD_DATA_BITS)
+
 // 32.768 kHz oscillator
 #define GP2CTL          ((uint32_t *)0x20101080)
 #define GP2DIV          (GP2CTL + 0x4/4)
 #define GP2CTL_VAL      (0x5a000000 + 0x291)
 #define GP2DIV_VAL      (0x5a000000 + 0x00249F00)
 
-// CRC polynomials
-#define CRC7_POLY    (uint8_t)(0b10001001 << 1)
-#define CRC16R_POLY  (1<<(15-0) | 1<<(15-5) | 1<<(15-12))
-
 // Bit counts
 #define BLOCK_ACK_BITS  8
 #define MSG_BITS        48
@@ -62,7 +65,27 @@
 
 // Delays
 #define SD_CLK_DELAY    1   // Clock on/off time in usec
+#define SD_CLK_NSEC     1000 // Default clock on/off time in nsec
+#define SD_CLK_MIN_NSEC 50  // Minimum clock on/off time for auto-tune
+#define SD_DRIVE        3   // Default pad drive strength (8 mA)
+#define SD_TUNE_STEP    80  // Auto-tune step, percentage of last value
+#define SD_TUNE_CHECKS  8   // Number of checks per auto-tune step
+#define SD_DELAY()      cycdelay(sd_clk_cycles)
 #define RSP_WAIT        20  // Number of clock cycles to wait for resp
+#define DATA_WAIT       1000 // Number of clock cycles to wait for data block
+#define SD_POLL_BYTES   16  // Bytes sent between calls to poll hook
+
+// Idle clock modes: clocked on every call to sdio_idle from application loop,
+// only while the driver is waiting for a response or interrupt, or in the
+// background from a timer interrupt while the bus is idle (interrupt armed)
+#define SD_IDLE_CONT    0
+#define SD_IDLE_WAIT    1
+#define SD_IDLE_TIMER   2
+#define SD_IDLE_USEC    50  // Timer clock half-period in usec
+
+// Data read CRC error (if CRC check is deferred), and retry count
+#define SD_CRC_ERR      (-1)
+#define SD_CRC_RETRIES  2
 
 // Macros to reorder items in structure
 #define BITF1(typ, a)             typ a
@@ -139,6 +162,7 @@ typedef union
 {
     SDIO_MSG_STRUCT     msg;
     SDIO_RSP3_STRUCT    rsp3;
+    SDIO_RSP5_STRUCT    rsp5;
     SDIO_CMD7_STRUCT    cmd7;
     SDIO_CMD52_STRUCT   cmd52;
     SDIO_RSP52_STRUCT   rsp52;
@@ -146,6 +170,40 @@ typedef union
     uint8_t             data[MSG_BYTES+2];
 } SDIO_MSG;
 
+// SDIO transport: command & response (including CMD52), CMD53 byte-mode
+// read & write, CMD53 block-mode read & write, and interrupt check
+typedef struct
+{
+    char *name;
+    int (*cmd)(SDIO_MSG *cmdp, SDIO_MSG *rsp);
+    int (*cmd53_read)(int func, int addr, uint8_t *dp, int nbytes);
+    int (*cmd53_write)(int func, int addr, uint8_t *dp, int nbytes);
+    int (*read_blocks)(int func, int addr, uint8_t *dp, int nblocks);
+    int (*write_blocks)(int func, int addr, uint8_t *dp, int nblocks);
+    int (*irq)(void);
+} SDIO_TRANSPORT;
+
+// Backplane batch operation: register (function 0 or 1) or windowed address
+typedef struct
+{
+    uint32_t addr, val;
+    uint8_t func, wr, nbytes, ok;
+} BAK_OP;
+
+// Backplane batch settings
+#define BAK_MAX_OPS     32  // Max operations in a batch
+#define BAK_MAX_XFER    64  // Max bytes in a merged transfer
+#define BAK_FUNC_WIN    0x80 // Function code for windowed backplane address
+#define BAK_FUNC_SYNC   0x81 // Function code for ordering barrier
+
+// Backplane batch queueing
+#define bak_queue_read(addr, n)             bak_queue(BAK_FUNC_WIN, addr, 0, n, SD_RD)
+#define bak_queue_write(addr, val, n)       bak_queue(BAK_FUNC_WIN, addr, val, n, SD_WR)
+#define bak_queue_reg_read(func, addr, n)   bak_queue(func, addr, 0, n, SD_RD)
+#define bak_queue_reg_write(func, addr, val, n) bak_queue(func, addr, val, n, SD_WR)
+#define bak_queue_sync()                    bak_queue(BAK_FUNC_SYNC, 0, 0, 0, 0)
+#define bak_result(n)                       (bak_ops[n].val)
+
 // Union to handle 8/16/32 bit conversions
 typedef union
 {
@@ -171,12 +229,49 @@ typedef union
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
+extern SDIO_TRANSPORT *sdio_bus, sdio_bitbang;
+extern int crc_errors, sd_clk_ns, sd_clk_cycles, sd_drive;
+extern void (*sdio_poll_hook)(void);
+extern void (*sdio_irq_callback)(void);
+extern volatile int sdio_irq_armed, sdio_irq_flag;
+extern int sd_idle_mode;
+extern BAK_OP bak_ops[BAK_MAX_OPS];
+extern int bak_nops, bak_xfers, bak_wins;
+extern GPIO_PROFILE sd_data_out, sd_data_in, sd_cmd_out, sd_cmd_in;
+
+void sdio_set_transport(SDIO_TRANSPORT *tp);
+int sdio_irq(void);
+int sdio_read_blocks(int func, int addr, uint8_t *dp, int nblocks);
+int sdio_bb_read_blocks(int func, int addr, uint8_t *dp, int nblocks);
+int sdio_bb_write_blocks(int func, int addr, uint8_t *dp, int nblocks);
+int sdio_bb_cmd53_write(int func, int addr, uint8_t *dp, int nbytes);
+int sdio_bb_cmd53_read(int func, int addr, uint8_t *dp, int nbytes);
+int sdio_bb_irq(void);
+void sdio_irq_init(void (*callback)(void));
+void sdio_irq_arm(void);
+void sdio_irq_disarm(void);
+void sdio_irq_handler(void);
+int sdio_idle_mode(int mode);
+void sdio_idle(void);
+void sdio_idle_clock(void);
+void sdio_wait_clock(void);
+int sdio_idle_wait(int usec);
+void sdio_set_clk_ns(int nsec);
+void sdio_set_drive(int drive);
+int sdio_clk_check(uint32_t cccr, uint32_t chipid);
+int sdio_clk_tune(int min_ns, int max_ns, int drive);
 void sdio_bak_window(uint32_t addr);
+void sdio_bak_window_reset(void);
 uint32_t sdio_bak_addr(uint32_t addr);
 int sdio_cmd7(int rca, SDIO_MSG *rsp);
 int sdio_write_blocks(int func, int addr, uint8_t *dp, int nblocks);
 int sdio_bak_write32(uint32_t addr, uint32_t val);
 int sdio_bak_read32(uint32_t addr, uint32_t *valp);
+void bak_batch_start(void);
+int bak_queue(int func, uint32_t addr, uint32_t val, int nbytes, int wr);
+int bak_batch_run(void);
+int bak_same_group(BAK_OP *op1, BAK_OP *op2);
+int bak_xfer(uint8_t *idx, int nops, int len);
 int sdio_cmd53_write(int func, int addr, uint8_t *dp, int nbytes);
 int sdio_cmd53_read(int func, int addr, uint8_t *dp, int nbytes);
 int sdio_cmd52_reads_check(int func, int addr, uint32_t mask, uint32_t val, int nbytes);
@@ -189,21 +284,20 @@ void sdio_cmd_write(uint8_t *data, int nbits);
 int sdio_rsp_block_write(uint8_t *rsp, uint8_t *dp, int nbytes);
 void sdio_block_out(uint8_t *dp, int nbytes);
 int sdio_rsp_block_read(uint8_t *rspd, uint8_t *data, int nbytes, uint64_t *crcp);
+int sdio_block_read(uint8_t *dp, int nbytes, uint64_t *crcp);
+uint64_t sdio_data_in(uint8_t *dp, int nbytes, int nd, uint64_t qcrc, uint8_t *crcd);
 int sdio_rsp_read(uint8_t *rsp, int nbits, int pin);
 void clk_0(int cycles);
-void crc7_init(void);
 void add_crc7(uint8_t *data);
-uint8_t crc7_byte(uint8_t b);
-uint8_t crc7_data(uint8_t *data, int n);
 void usdelay(int usec);
 int ustimeout(int *tickp, int usec);
-void qcrc16r_init(void);
-uint64_t quadval(uint16_t val);
+void dout_init(void);
 void disp_msg(SDIO_MSG *smf);
 void disp_cmd52(SDIO_MSG *smf);
 void disp_rsp52(SDIO_MSG *smf);
 void disp_cmd53(SDIO_MSG *smf);
 void disp_rsp53(SDIO_MSG *smf);
+void sdio_crc_defer(int on);
 void log_enable(int on);
 void log_incr(void);
 void log_msg(SDIO_MSG *msgp);
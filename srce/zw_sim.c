@@ -0,0 +1,579 @@
+// ZeroWi bare-metal WiFi driver, see https://iosoft.blog/zerowi
+// In-memory CYW43430 chip model, used as an SDIO transport on a host
+//
+// Copyright (c) 2020 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "whd_types.h"
+#include "whd_wlioctl.h"
+#include "whd_events.h"
+
+#include "zw_gpio.h"
+#include "zw_sdio.h"
+#include "zw_regs.h"
+#include "zw_ioctl.h"
+#include "zw_sim.h"
+
+// Function 1 SDIO core registers
+#define F1_REG_BASE     0x10000
+#define F1_REG_SIZE     0x20
+
+// Backplane register
+typedef struct {
+    uint32_t addr, val;
+} SIM_REG;
+
+SDIO_TRANSPORT sdio_sim = {"sim", sim_cmd, sim_cmd53_read,
+    sim_cmd53_write, sim_read_blocks, sim_write_blocks, sim_irq};
+SIM_STATS sim_stats;
+
+uint8_t sim_ram[SIM_RAM_SIZE], sim_cccr[0x300], sim_f1regs[F1_REG_SIZE];
+SIM_REG sim_regs[SIM_MAX_REGS];
+int sim_nregs, sim_cpu_running;
+
+// Rx frame queue
+uint8_t sim_frames[SIM_MAX_FRAMES][SIM_FRAME_LEN], sim_rxseq;
+int sim_frame_lens[SIM_MAX_FRAMES], sim_rx_in, sim_rx_out, sim_rx_pos;
+// Next frame to be indicated in the interrupt status
+int sim_rx_ind;
+// Firmware response time, and time each Rx frame becomes available
+int sim_resp_usec, sim_frame_times[SIM_MAX_FRAMES];
+uint8_t sim_evt_mask[EVENT_MAX / 8];
+
+// Interrupt controller: CPU enable, peripheral enables & handlers
+int sim_cpu_irq_on;
+uint32_t sim_irq_enables[SIM_NUM_IRQS / 32];
+void (*sim_irq_handlers[SIM_NUM_IRQS])(void);
+
+uint32_t sim_reg_read(uint32_t addr);
+void sim_reg_write(uint32_t addr, uint32_t val);
+uint8_t sim_bak_rdbyte(uint32_t addr);
+void sim_bak_wrbyte(uint32_t addr, uint8_t b);
+void sim_f0_read(int addr, uint8_t *dp, int nbytes);
+void sim_f0_write(int addr, uint8_t *dp, int nbytes);
+void sim_f1_read(int addr, uint8_t *dp, int nbytes);
+void sim_f1_write(int addr, uint8_t *dp, int nbytes);
+void sim_f2_read(uint8_t *dp, int nbytes);
+void sim_f2_write(uint8_t *dp, int nbytes);
+void sim_ioctl(IOCTL_CMD *cmdp);
+uint8_t *sim_frame_alloc(int len);
+void sim_cccr_reset(void);
+void sim_irq_check(void);
+int sim_frame_ready(void);
+void sim_int_update(void);
+
+// Initialise chip model
+void sim_init(void)
+{
+    memset(sim_ram, 0, sizeof(sim_ram));
+    sim_cccr_reset();
+    memset(sim_f1regs, 0, sizeof(sim_f1regs));
+    memset(sim_evt_mask, 0, sizeof(sim_evt_mask));
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    sim_nregs = sim_cpu_running = 0;
+    sim_rx_in = sim_rx_out = sim_rx_pos = sim_rx_ind = 0;
+    sim_reg_write(BAK_BASE_ADDR, SIM_CHIP_ID);
+    sim_reg_write(ARM_RESETCTRL_REG, 1);
+    sim_d1_update();
+}
+
+// Command & response, return response length in bits
+int sim_cmd(SDIO_MSG *cmdp, SDIO_MSG *rsp)
+{
+    SDIO_CMD52_STRUCT *c52 = &cmdp->cmd52;
+    int addr = REG_ADDR(cmdp->cmd52);
+    uint8_t val=0;
+
+    sim_stats.cmds++;
+    if (cmdp->msg.num == 52)
+    {
+        if (c52->func == SD_FUNC_BUS)
+        {
+            if (c52->wr)
+                sim_f0_write(addr, &c52->data, 1);
+            sim_f0_read(addr, &val, 1);
+        }
+        else if (c52->func == SD_FUNC_BAK)
+        {
+            if (c52->wr)
+                sim_f1_write(addr, &c52->data, 1);
+            sim_f1_read(addr, &val, 1);
+        }
+    }
+    if (rsp)
+    {
+        memset(rsp->data, 0, MSG_BYTES);
+        rsp->msg.num = cmdp->msg.num;
+        rsp->msg.stop = 1;
+        if (cmdp->msg.num == 52)
+            rsp->rsp52.data = val;
+        else if (cmdp->msg.num == 3)
+            rsp->rsp3.rcax = SWAP16(1);
+        else if (cmdp->msg.num == 5)
+            rsp->msg.argx = SWAP32(SIM_OCR);
+    }
+    return(MSG_BITS);
+}
+
+// Command 53 read
+int sim_cmd53_read(int func, int addr, uint8_t *dp, int nbytes)
+{
+    uint8_t temp[SD_RAD_BLK_BYTES];
+
+    nbytes = nbytes ? nbytes : SD_RAD_BLK_BYTES;
+    dp = dp ? dp : temp;
+    sim_stats.cmd53_reads++;
+    sim_stats.rd_bytes += nbytes;
+    if (func == SD_FUNC_BUS)
+        sim_f0_read(addr, dp, nbytes);
+    else if (func == SD_FUNC_BAK)
+        sim_f1_read(addr, dp, nbytes);
+    else
+        sim_f2_read(dp, nbytes);
+    return(nbytes);
+}
+
+// Command 53 write
+int sim_cmd53_write(int func, int addr, uint8_t *dp, int nbytes)
+{
+    sim_stats.cmd53_writes++;
+    sim_stats.wr_bytes += nbytes;
+    if (func == SD_FUNC_BUS)
+        sim_f0_write(addr, dp, nbytes);
+    else if (func == SD_FUNC_BAK)
+        sim_f1_write(addr, dp, nbytes);
+    else if (func == SD_FUNC_RAD)
+        sim_f2_write(dp, nbytes);
+    return(nbytes);
+}
+
+// Multi-block read, return number of blocks
+// A function 2 read stops at the end of the current frame, then pads with zeros
+int sim_read_blocks(int func, int addr, uint8_t *dp, int nblocks)
+{
+    int n, blksize = func==SD_FUNC_RAD ? SD_RAD_BLK_BYTES : SD_BAK_BLK_BYTES;
+    int fend=0;
+    uint8_t temp[SD_RAD_BLK_BYTES], *p;
+
+    sim_stats.blk_reads++;
+    sim_stats.rd_bytes += nblocks * blksize;
+    for (n=0; n<nblocks; n++)
+    {
+        p = dp ? &dp[n * blksize] : temp;
+        if (func == SD_FUNC_BAK)
+            sim_f1_read(addr + n*blksize, p, blksize);
+        else if (func == SD_FUNC_RAD && !fend)
+        {
+            sim_f2_read(p, blksize);
+            fend = sim_rx_pos == 0;
+        }
+        else
+            memset(p, 0, blksize);
+    }
+    return(nblocks);
+}
+
+// Multi-block write, return number of blocks
+int sim_write_blocks(int func, int addr, uint8_t *dp, int nblocks)
+{
+    int blksize = func==SD_FUNC_RAD ? SD_RAD_BLK_BYTES : SD_BAK_BLK_BYTES;
+
+    sim_stats.blk_writes++;
+    sim_stats.wr_bytes += nblocks * blksize;
+    if (func == SD_FUNC_BAK)
+        sim_f1_write(addr, dp, nblocks * blksize);
+    else if (func == SD_FUNC_RAD)
+        sim_f2_write(dp, nblocks * blksize);
+    return(nblocks);
+}
+
+// Return non-zero if interrupt pending (status bit set, and enabled in host mask)
+int sim_irq(void)
+{
+    sim_int_update();
+    return((sim_reg_read(SB_INT_STATUS_REG) & sim_reg_read(SB_INT_HOST_MASK_REG)) != 0);
+}
+
+// Return non-zero if Rx frame available
+int sim_frame_ready(void)
+{
+    return(sim_rx_in != sim_rx_out &&
+           (!sim_resp_usec || ustime() - sim_frame_times[sim_rx_out] >= 0));
+}
+
+// Set frame indication in interrupt status, as each Rx frame becomes available
+// (so after write-1-to-clear, it isn't set again for frames already indicated)
+void sim_int_update(void)
+{
+    while (sim_rx_ind != sim_rx_in &&
+           (!sim_resp_usec || ustime() - sim_frame_times[sim_rx_ind] >= 0))
+    {
+        sim_reg_write(SB_INT_STATUS_REG, sim_reg_read(SB_INT_STATUS_REG) | SIM_FRAME_IND);
+        sim_rx_ind = (sim_rx_ind + 1) % SIM_MAX_FRAMES;
+    }
+}
+
+// Queue an event, if enabled, return non-zero if OK
+int sim_event(int type, int status, int dlen)
+{
+    int len = sizeof(IOCTL_EVENT_HDR) + offsetof(ETH_EVENT_FRAME, event.data) + dlen;
+    int hlen = len - sizeof(IOCTL_EVENT_HDR) - offsetof(ETH_EVENT_FRAME, event);
+    uint8_t *frame, oui[3] = {0x00, 0x10, 0x18};
+    ETH_EVENT_FRAME *eep;
+
+    if (type<0 || type>=EVENT_MAX || !(sim_evt_mask[type/8] & (1 << (type & 7))) ||
+        (frame = sim_frame_alloc(len)) == 0)
+        return(0);
+    ((IOCTL_EVENT_HDR *)frame)->chan = 1;
+    eep = (ETH_EVENT_FRAME *)&frame[sizeof(IOCTL_EVENT_HDR)];
+    eep->eth_hdr.ethertype = SWAP16(0x886c);
+    eep->event.hdr.subtype = SWAP16(0x8001);
+    eep->event.hdr.length = SWAP16(hlen);
+    memcpy(eep->event.hdr.oui, oui, sizeof(oui));
+    eep->event.hdr.usr_subtype = SWAP16(1);
+    eep->event.msg.version = SWAP16(2);
+    eep->event.msg.event_type = SWAP32(type);
+    eep->event.msg.status = SWAP32(status);
+    eep->event.msg.datalen = SWAP32(dlen);
+    sim_d1_update();
+    return(1);
+}
+
+// Display transaction counts
+void sim_disp_stats(void)
+{
+    printf("%u cmds, %u CMD53 reads, %u CMD53 writes, %u block reads, %u block writes, "
+           "%u bytes read, %u written\n", sim_stats.cmds, sim_stats.cmd53_reads,
+           sim_stats.cmd53_writes, sim_stats.blk_reads, sim_stats.blk_writes,
+           sim_stats.rd_bytes, sim_stats.wr_bytes);
+}
+
+// Read function 0: CCCR, I/O ready depends on CPU state
+void sim_f0_read(int addr, uint8_t *dp, int nbytes)
+{
+    while (nbytes--)
+    {
+        *dp++ = addr >= sizeof(sim_cccr) ? 0 : addr == BUS_IORDY_REG ?
+                sim_cccr[BUS_IOEN_REG] & (sim_cpu_running ? 6 : 2) : sim_cccr[addr];
+        addr++;
+    }
+}
+
+// Write function 0: CCCR, I/O reset sets all registers to defaults,
+// including the backplane window
+void sim_f0_write(int addr, uint8_t *dp, int nbytes)
+{
+    for (; nbytes--; addr++, dp++)
+    {
+        if (addr < sizeof(sim_cccr))
+        {
+            sim_cccr[addr] = *dp;
+            if (addr==BUS_IOABORT_REG && (*dp & BUS_IO_RESET))
+            {
+                sim_cccr_reset();
+                memset(&sim_f1regs[BAK_WIN_ADDR_REG - F1_REG_BASE], 0, 3);
+            }
+        }
+    }
+}
+
+// Set CCCR default values
+void sim_cccr_reset(void)
+{
+    memset(sim_cccr, 0, sizeof(sim_cccr));
+    sim_cccr[BUS_BRCM_CARDCTRL] = 1;
+}
+
+// Read function 1: SDIO core registers, or backplane via window
+void sim_f1_read(int addr, uint8_t *dp, int nbytes)
+{
+    uint32_t win = sim_f1regs[0xa]<<8 | sim_f1regs[0xb]<<16 | sim_f1regs[0xc]<<24;
+    uint8_t b;
+
+    while (nbytes--)
+    {
+        if (addr >= F1_REG_BASE && addr < F1_REG_BASE+F1_REG_SIZE)
+        {
+            b = sim_f1regs[addr - F1_REG_BASE];
+            if (addr == BAK_CHIP_CLOCK_CSR_REG)
+            {
+                b |= b & (CSR_ALP_REQ|CSR_HT_REQ|CSR_FORCE_ALP) ? CSR_ALP_AVAIL : 0;
+                b |= b & CSR_HT_REQ && sim_cpu_running ? CSR_HT_AVAIL : 0;
+            }
+        }
+        else
+            b = sim_bak_rdbyte(win | (addr & SB_ADDR_MASK));
+        *dp++ = b;
+        addr++;
+    }
+}
+
+// Write function 1: SDIO core registers, or backplane via window
+void sim_f1_write(int addr, uint8_t *dp, int nbytes)
+{
+    uint32_t win = sim_f1regs[0xa]<<8 | sim_f1regs[0xb]<<16 | sim_f1regs[0xc]<<24;
+
+    while (nbytes--)
+    {
+        if (addr >= F1_REG_BASE && addr < F1_REG_BASE+F1_REG_SIZE)
+            sim_f1regs[addr - F1_REG_BASE] = *dp++;
+        else
+            sim_bak_wrbyte(win | (addr & SB_ADDR_MASK), *dp++);
+        addr++;
+    }
+}
+
+// Read backplane byte from RAM or register
+uint8_t sim_bak_rdbyte(uint32_t addr)
+{
+    uint32_t val;
+
+    if (addr < SIM_RAM_SIZE)
+        return(sim_ram[addr]);
+    if ((addr & ~3) == SB_INT_STATUS_REG)
+        sim_int_update();
+    val = sim_reg_read(addr & ~3);
+    return((uint8_t)(val >> (addr & 3)*8));
+}
+
+// Write backplane byte to RAM or register, with side-effects
+// when the m.s.byte of a register is written
+void sim_bak_wrbyte(uint32_t addr, uint8_t b)
+{
+    uint32_t a=addr & ~3, shift=(addr & 3)*8, val;
+
+    if (addr < SIM_RAM_SIZE)
+    {
+        sim_ram[addr] = b;
+        return;
+    }
+    val = (sim_reg_read(a) & ~(0xff << shift)) | (uint32_t)b << shift;
+    if (a == SB_INT_STATUS_REG)
+        val = sim_reg_read(a) & ~((uint32_t)b << shift);
+    sim_reg_write(a, val);
+    if (shift == 24 && a == ARM_RESETCTRL_REG && val == 0)
+        sim_cpu_running = 1;
+    if (a == SB_INT_STATUS_REG || a == SB_INT_HOST_MASK_REG)
+        sim_d1_update();
+}
+
+// Get backplane register value
+uint32_t sim_reg_read(uint32_t addr)
+{
+    int i;
+
+    for (i=0; i<sim_nregs; i++)
+    {
+        if (sim_regs[i].addr == addr)
+            return(sim_regs[i].val);
+    }
+    return(0);
+}
+
+// Set backplane register value
+void sim_reg_write(uint32_t addr, uint32_t val)
+{
+    int i;
+
+    for (i=0; i<sim_nregs && sim_regs[i].addr!=addr; i++) ;
+    if (i < SIM_MAX_REGS)
+    {
+        sim_regs[i].addr = addr;
+        sim_regs[i].val = val;
+        sim_nregs = MAX(sim_nregs, i+1);
+    }
+}
+
+// Read function 2 (radio) data from the current Rx frame
+// A read never extends into the next frame; if past the end, pad with zeros
+void sim_f2_read(uint8_t *dp, int nbytes)
+{
+    int n=0, len;
+
+    sim_int_update();
+    if (sim_frame_ready())
+    {
+        len = sim_frame_lens[sim_rx_out];
+        n = MIN(nbytes, len - sim_rx_pos);
+        memcpy(dp, &sim_frames[sim_rx_out][sim_rx_pos], n);
+        sim_rx_pos += n;
+        if (sim_rx_pos >= len || n < nbytes)
+        {
+            sim_rx_out = (sim_rx_out + 1) % SIM_MAX_FRAMES;
+            sim_rx_pos = 0;
+        }
+    }
+    memset(&dp[n], 0, nbytes - n);
+    sim_d1_update();
+}
+
+// Write function 2 (radio) frame, and process IOCTL
+// A glommed superframe has subframes, each padded, the last one flagged
+void sim_f2_write(uint8_t *dp, int nbytes)
+{
+    IOCTL_MSG *msgp;
+    IOCTL_GLOM_HDR *ghp;
+    int n=0;
+
+    while (n + sizeof(IOCTL_MSG) - IOCTL_MAX_BLKLEN - sizeof(IOCTL_GLOM_HDR) <= nbytes)
+    {
+        msgp = (IOCTL_MSG *)&dp[n];
+        ghp = &msgp->glom_cmd.glom_hdr;
+        if (msgp->len != (msgp->notlen ^ 0xffff))
+            break;
+        if (msgp->cmd.hdrlen == 12 && msgp->cmd.chan == 0)
+        {
+            sim_ioctl(&msgp->cmd);
+            break;
+        }
+        if (msgp->glom_cmd.cmd.hdrlen != 20 || msgp->glom_cmd.cmd.chan != 0)
+            break;
+        sim_ioctl(&msgp->glom_cmd.cmd);
+        if (ghp->flags & 1)
+            break;
+        sim_stats.glom_subframes++;
+        n += msgp->len + (ghp->pad[0] | ghp->pad[1] << 8);
+    }
+    sim_d1_update();
+}
+
+// Process IOCTL command, queue the response
+void sim_ioctl(IOCTL_CMD *cmdp)
+{
+    int n, namelen=0, len=sizeof(IOCTL_MSG) - IOCTL_MAX_BLKLEN - sizeof(IOCTL_GLOM_HDR);
+    uint8_t mac[6]=SIM_MAC_ADDR, *data=cmdp->data;
+    char *name = (char *)cmdp->data;
+    IOCTL_MSG *rsp;
+
+    len += MIN(cmdp->outlen, IOCTL_MAX_BLKLEN);
+    if (cmdp->cmd==WLC_GET_VAR || cmdp->cmd==WLC_SET_VAR)
+    {
+        namelen = strnlen(name, IOCTL_MAX_BLKLEN-1) + 1;
+        data += namelen;
+    }
+    if ((rsp = (IOCTL_MSG *)sim_frame_alloc(len)) == 0)
+        return;
+    rsp->cmd.cmd = cmdp->cmd;
+    rsp->cmd.outlen = cmdp->outlen;
+    rsp->cmd.flags = cmdp->flags;
+    if (cmdp->cmd == WLC_GET_VAR)
+    {
+        if (!strcmp(name, "ver"))
+            strcpy((char *)rsp->cmd.data, SIM_VERSION);
+        else if (!strcmp(name, "cur_etheraddr"))
+            memcpy(rsp->cmd.data, mac, sizeof(mac));
+    }
+    else if (cmdp->cmd == WLC_SET_VAR && !strcmp(name, "event_msgs"))
+        memcpy(sim_evt_mask, data, MIN(sizeof(sim_evt_mask), cmdp->outlen - namelen));
+    else if (cmdp->cmd == WLC_SET_VAR && !strcmp(name, "escan"))
+    {
+        for (n=0; n<SIM_ESCAN_RESULTS; n++)
+            sim_event(WLC_E_ESCAN_RESULT, WLC_E_STATUS_PARTIAL, SIM_ESCAN_DLEN);
+        sim_event(WLC_E_ESCAN_RESULT, WLC_E_STATUS_SUCCESS, 0);
+    }
+    else if (cmdp->cmd == WLC_SET_SSID)
+    {
+        sim_event(WLC_E_LINK, WLC_E_STATUS_SUCCESS, 0);
+        sim_event(WLC_E_SET_SSID, WLC_E_STATUS_SUCCESS, 0);
+    }
+}
+
+// Drive the data bit 1 level in the GPIO register file (low if interrupt pending)
+// On a falling edge, if detection is enabled, flag the event & interrupt
+void sim_d1_update(void)
+{
+    volatile uint32_t *lev=GPIO_BANK(GPIO_LEV0, SD_D1_PIN);
+    volatile uint32_t *eds=GPIO_BANK(GPIO_EDS0, SD_D1_PIN), *fen=GPIO_BANK(GPIO_FEN0, SD_D1_PIN);
+    uint32_t mask=GPIO_MASK(SD_D1_PIN), old=*lev & mask;
+
+    *lev = sim_irq() ? *lev & ~mask : *lev | mask;
+    if (old && !(*lev & mask) && (*fen & mask))
+    {
+        *eds |= mask;
+        sim_irq_check();
+    }
+}
+
+// Call the handlers of enabled interrupts with GPIO events pending
+void sim_irq_check(void)
+{
+    int irq;
+
+    for (irq=IRQ_GPIO_BANK0; sim_cpu_irq_on && irq<=IRQ_GPIO_BANK1; irq++)
+    {
+        if (*GPIO_BANK(GPIO_EDS0, (irq-IRQ_GPIO_BANK0)*32) &&
+            sim_irq_enables[irq/32] & (1u << (irq%32)) && sim_irq_handlers[irq])
+            sim_irq_handlers[irq]();
+    }
+}
+
+// Simulated interrupt controller, replacing the SDK functions
+void CPU_irq_attach(int irq, void (*handler)(void))
+{
+    if (irq >= 0 && irq < SIM_NUM_IRQS)
+    {
+        sim_irq_handlers[irq] = handler;
+        sim_irq_enables[irq/32] |= 1u << (irq%32);
+        sim_irq_check();
+    }
+}
+void CPU_irq_detach(int irq)
+{
+    if (irq >= 0 && irq < SIM_NUM_IRQS)
+    {
+        sim_irq_enables[irq/32] &= ~(1u << (irq%32));
+        sim_irq_handlers[irq] = 0;
+    }
+}
+void CPU_irq_enable(void)
+{
+    sim_cpu_irq_on = 1;
+    sim_irq_check();
+}
+void CPU_irq_disable(void)
+{
+    sim_cpu_irq_on = 0;
+}
+
+// Allocate a zeroed frame at the end of the Rx queue, with SDPCM header
+// Return null if queue is full
+uint8_t *sim_frame_alloc(int len)
+{
+    int next = (sim_rx_in + 1) % SIM_MAX_FRAMES;
+    IOCTL_EVENT_HDR *hp;
+
+    if (next == sim_rx_out || len > SIM_FRAME_LEN)
+    {
+        sim_stats.frames_lost++;
+        return(0);
+    }
+    hp = (IOCTL_EVENT_HDR *)sim_frames[sim_rx_in];
+    memset(hp, 0, len);
+    hp->notlen = ~(hp->len = len);
+    hp->seq = sim_rxseq++;
+    hp->hdrlen = sizeof(IOCTL_EVENT_HDR);
+    hp->credit = hp->seq + 8;
+    sim_frame_lens[sim_rx_in] = len;
+    sim_frame_times[sim_rx_in] = ustime() + sim_resp_usec;
+    sim_rx_in = next;
+    return((uint8_t *)hp);
+}
+
+// EOF
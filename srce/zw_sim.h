@@ -0,0 +1,63 @@
+// ZeroWi bare-metal WiFi driver, see https://iosoft.blog/zerowi
+// In-memory CYW43430 chip model definitions
+//
+// Copyright (c) 2020 Jeremy P Bentham
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define SIM_RAM_SIZE        0x80000     // Chip RAM size
+#define SIM_MAX_REGS        64          // Max number of backplane registers
+#define SIM_MAX_FRAMES      16          // Max number of queued Rx frames
+#define SIM_FRAME_LEN       1600        // Max Rx frame length
+#define SIM_CHIP_ID         0x1541a9a6  // CYW43430 chip ID
+#define SIM_OCR             0xa0ff8000  // CMD5 response: ready, 2 functions
+#define SIM_ESCAN_RESULTS   8           // Escan results for each scan request
+#define SIM_ESCAN_DLEN      1400        // Length of escan result data
+#define SIM_VERSION         "wl0: zerowi simulation"
+#define SIM_MAC_ADDR        {0x00,0x90,0x4c,0xc5,0x12,0x38}
+#define SIM_NUM_IRQS        64          // Interrupt controller sources
+
+// Interrupt status bit for frame available
+#define SIM_FRAME_IND       SB_INT_FRAME_IND
+
+// Transaction counts
+typedef struct {
+    int cmds,           // Commands, including CMD52
+        cmd53_reads,    // CMD53 byte-mode reads
+        cmd53_writes,   // CMD53 byte-mode writes
+        blk_reads,      // CMD53 block-mode reads
+        blk_writes,     // CMD53 block-mode writes
+        rd_bytes,       // Data bytes read
+        wr_bytes,       // Data bytes written
+        frames_lost,    // Rx frames lost due to full queue
+        glom_subframes; // Tx subframes followed by another in a superframe
+} SIM_STATS;
+
+extern SDIO_TRANSPORT sdio_sim;
+extern SIM_STATS sim_stats;
+extern uint8_t sim_evt_mask[EVENT_MAX / 8];
+extern uint8_t sim_ram[SIM_RAM_SIZE];
+extern int sim_resp_usec;
+
+void sim_init(void);
+int sim_cmd(SDIO_MSG *cmdp, SDIO_MSG *rsp);
+int sim_cmd53_read(int func, int addr, uint8_t *dp, int nbytes);
+int sim_cmd53_write(int func, int addr, uint8_t *dp, int nbytes);
+int sim_read_blocks(int func, int addr, uint8_t *dp, int nblocks);
+int sim_write_blocks(int func, int addr, uint8_t *dp, int nblocks);
+int sim_irq(void);
+int sim_event(int type, int status, int dlen);
+void sim_d1_update(void);
+void sim_disp_stats(void);
+
+// EOF